@@ -0,0 +1,249 @@
+#include <sys/resource.h>
+
+#include "lambda.h"
+
+// Definitions shared by every workload. They are bound around the workload
+// term in this order, so each one may use the ones above it. All of them also
+// work under call-by-value: recursion goes through Z, and conditional branches
+// are thunks that the chosen branch applies to I.
+static const char *prelude[][2] = {
+    {"I", "\\x. x"},
+    {"true", "\\t f. t"},
+    {"false", "\\t f. f"},
+    {"not", "\\b. b false true"},
+    {"and", "\\p q. p q p"},
+    {"zero", "\\f x. x"},
+    {"succ", "\\n f x. f (n f x)"},
+    {"add", "\\m n f x. m f (n f x)"},
+    {"mul", "\\m n f. m (n f)"},
+    {"pow", "\\m n. n m"},
+    {"iszero", "\\n. n (\\x. false) true"},
+    {"even", "\\n. n not true"},
+    {"pair", "\\a b s. s a b"},
+    {"fst", "\\p. p true"},
+    {"snd", "\\p. p false"},
+    {"pred", "\\n. fst (n (\\p. pair (snd p) (succ (snd p))) (pair zero zero))"},
+    {"sub", "\\m n. n pred m"},
+    {"leq", "\\m n. iszero (sub m n)"},
+    {"eq", "\\m n. and (leq m n) (leq n m)"},
+    {"Z", "\\f. (\\x. f (\\v. x x v)) (\\x. f (\\v. x x v))"},
+    {"nil", "\\n c. n"},
+    {"cons", "\\h t n c. c h t"},
+};
+
+// Every workload evaluates to true, which is how its result is checked.
+typedef struct {
+  const char *name;
+  const char *term;   // named syntax; #n stands for the Church numeral n
+  const char *quoted; // if set, its Mogensen encoding is applied to term
+} Workload;
+
+static const Workload workloads[] = {
+    {"church-add", "not (even (add #40000 #30001))"},
+    {"church-mul", "even (mul #400 #500)"},
+    {"church-exp", "not (even (pow #3 #11))"},
+    {"factorial",
+     "eq (Z (\\fact n. iszero n (\\d. #1) (\\d. mul n (fact (pred n))) I) #5) "
+     "#120"},
+    {"fibonacci",
+     "eq (Z (\\fib n. leq n #1 (\\d. n) "
+     "(\\d. add (fib (pred n)) (fib (pred (pred n)))) I) #12) #144"},
+    {"ackermann", "eq ((\\m. m (\\f n. n f (f #1)) succ) #3 #5) #253"},
+    {"scott-sort",
+     "(\\insert. (\\sort. (\\equal. equal "
+     "(sort (cons #36 (cons #9 (cons #51 (cons #24 (cons #3 (cons #45 "
+     "(cons #18 (cons #57 (cons #12 (cons #33 (cons #6 (cons #42 (cons #27 "
+     "(cons #60 (cons #15 (cons #39 nil))))))))))))))))) "
+     "(cons #3 (cons #6 (cons #9 (cons #12 (cons #15 (cons #18 (cons #24 "
+     "(cons #27 (cons #33 (cons #36 (cons #39 (cons #42 (cons #45 "
+     "(cons #51 (cons #57 (cons #60 nil))))))))))))))))) "
+     "(Z (\\equal a b. a (\\d. b (\\d. true) (\\h t d. false) I) "
+     "(\\h t d. b (\\d. false) (\\g u d. and (eq h g) (equal t u)) I) I))) "
+     "(Z (\\sort l. l (\\d. nil) (\\h t d. insert h (sort t)) I))) "
+     "(Z (\\insert x l. l (\\d. cons x nil) (\\h t d. leq x h (\\d. cons x l) "
+     "(\\d. cons h (insert x t)) I) I))"},
+    {"self-interp",
+     "\\q. even (Z (\\e m. m (\\x. x) (\\m n. e m (e n)) (\\m v. e (m v))) q)",
+     "(\\m n f. m (n f)) #150 #120"},
+};
+
+static const char *engine_names[] = {
+    [ENGINE_EVAL] = "eval",       [ENGINE_KRIVINE] = "krivine",
+    [ENGINE_LAZY] = "lazy",       [ENGINE_VM] = "vm",
+    [ENGINE_JIT] = "jit",         [ENGINE_NORMALIZE] = "normalize",
+    [ENGINE_NET] = "net",
+};
+
+// Append `src` to `w`, expanding each #n into a Church numeral.
+static void put_source(Writer *w, const char *src) {
+  while (*src) {
+    if (*src != '#') {
+      writer_putc(w, *src++);
+      continue;
+    }
+    char *end;
+    unsigned long n = strtoul(src + 1, &end, 10);
+    src = end;
+    writer_put(w, "(\\f x. ", 7);
+    for (unsigned long i = 0; i < n; i++)
+      writer_put(w, "f (", 3);
+    writer_putc(w, 'x');
+    for (unsigned long i = 0; i <= n; i++)
+      writer_putc(w, ')');
+  }
+}
+
+static Expr *parse_source(const char *src, bool with_prelude) {
+  size_t defs = sizeof(prelude) / sizeof(*prelude);
+  Writer w = writer_mem();
+  for (size_t i = 0; with_prelude && i < defs; i++) {
+    writer_put(&w, "(\\", 2);
+    writer_put(&w, prelude[i][0], strlen(prelude[i][0]));
+    writer_put(&w, ". ", 2);
+  }
+  put_source(&w, src);
+  for (size_t i = defs; with_prelude && i-- > 0;) {
+    writer_put(&w, ") (", 3);
+    put_source(&w, prelude[i][1]);
+    writer_putc(&w, ')');
+  }
+
+  NamedParser np = named_parser(w.buf, arrlenu(w.buf));
+  Expr *expr = parse_named(&np);
+  if (!expr || parse_named(&np))
+    ERROR("Workload must be a single term");
+  named_parser_free(&np);
+  writer_free(&w);
+  return expr;
+}
+
+// Mogensen's encoding: x is \a b c. a x, M N is \a b c. b M N and \x. M is
+// \a b c. c (\x. M). `levels` maps each binder of the source term to the
+// depth of its counterpart in the encoding.
+static Expr *quote(const Expr *expr, Variable depth, Variable **levels) {
+  switch (expr->type) {
+  case EXPR_VAR: {
+    if (expr->var > (Variable)arrlenu(*levels))
+      ERROR("Quoted term must be closed");
+    Variable bound = (*levels)[arrlenu(*levels) - expr->var];
+    return new_abs(new_abs(
+        new_abs(new_app(new_var(3), new_var(depth + 4 - bound)))));
+  }
+  case EXPR_ABS: {
+    arrput(*levels, depth + 4);
+    Expr *body = quote(expr->abs.body, depth + 4, levels);
+    arrsetlen(*levels, arrlen(*levels) - 1);
+    return new_abs(new_abs(new_abs(new_app(new_var(1), new_abs(body)))));
+  }
+  case EXPR_APP: {
+    Expr *func = quote(expr->app.func, depth + 3, levels);
+    Expr *arg = quote(expr->app.arg, depth + 3, levels);
+    return new_abs(new_abs(new_abs(new_app(new_app(new_var(2), func), arg))));
+  }
+  }
+  return NULL;
+}
+
+static Expr *build(const Workload *wl) {
+  Expr *expr = parse_source(wl->term, true);
+  if (wl->quoted) {
+    Variable *levels = NULL;
+    expr = new_app(expr, quote(parse_source(wl->quoted, false), 0, &levels));
+    arrfree(levels);
+  }
+  return expr;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench(const Workload *wl, Engine engine, int runs) {
+  double *times = malloc(runs * sizeof(double));
+  uint64_t beta = 0;
+  size_t peak = 0;
+  Stack s = NULL;
+
+  for (int i = 0; i < runs; i++) {
+    jit_reset();
+    expr_reset();
+    Expr *expr = build(wl);
+
+    memset(&stats, 0, sizeof(stats));
+    double start = stats_clock();
+    Expr *res = run(engine, expr, &s);
+    times[i] = stats_clock() - start;
+    beta = stats.beta;
+    size_t used = arena_used(&expr_arena) + arena_used(&eval_arena);
+    peak = used > peak ? used : peak;
+
+    Expr *expect = new_abs(new_abs(new_var(2)));
+    if (!expr_equal(normalize(res), expect))
+      ERROR("%s on %s: wrong result", wl->name, engine_names[engine]);
+  }
+
+  qsort(times, runs, sizeof(double), compare_double);
+  double median = runs % 2 ? times[runs / 2]
+                           : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-12s %-9s %10.2f %12" PRIu64 " %9.2f %9.1f %8.1f\n", wl->name,
+         engine_names[engine], median * 1e3, beta, beta / median / 1e6,
+         peak / 1048576.0, ru.ru_maxrss / 1024.0);
+  fflush(stdout);
+  arrfree(s);
+  free(times);
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = sizeof(workloads) / sizeof(*workloads);
+  size_t engine_count = sizeof(engine_names) / sizeof(*engine_names);
+  bool selected[sizeof(workloads) / sizeof(*workloads)] = {0};
+  bool engines[sizeof(engine_names) / sizeof(*engine_names)] = {0};
+  bool any_workload = false, any_engine = false;
+  int runs = 5;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--runs=", 7)) {
+      runs = atoi(argv[i] + 7);
+      if (runs < 1)
+        ERROR("--runs must be positive");
+    } else if (!strncmp(argv[i], "--engine=", 9)) {
+      size_t e = 0;
+      while (e < engine_count && strcmp(argv[i] + 9, engine_names[e]))
+        e++;
+      if (e == engine_count)
+        ERROR("Unknown engine %s", argv[i] + 9);
+      engines[e] = any_engine = true;
+    } else if (argv[i][0] != '-') {
+      size_t w = 0;
+      while (w < count && strcmp(argv[i], workloads[w].name))
+        w++;
+      if (w == count)
+        ERROR("Unknown workload %s", argv[i]);
+      selected[w] = any_workload = true;
+    } else {
+      ERROR("Unknown option %s", argv[i]);
+    }
+  }
+
+  // The JIT would otherwise interpret the first runs of every term.
+  jit_threshold = 0;
+
+  printf("%-12s %-9s %10s %12s %9s %9s %8s\n", "workload", "engine",
+         "median_ms", "beta", "Mbeta/s", "arena_MB", "rss_MB");
+  for (size_t w = 0; w < count; w++) {
+    if (any_workload && !selected[w])
+      continue;
+    for (size_t e = 0; e < engine_count; e++)
+      if (any_engine ? engines[e] : e < ENGINE_NORMALIZE)
+        bench(&workloads[w], e, runs);
+  }
+
+  jit_reset();
+  expr_reset();
+  arena_free(&expr_arena);
+  arena_free(&eval_arena);
+  return 0;
+}
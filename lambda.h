@@ -0,0 +1,4439 @@
+// Lambda calculus terms, parsers and evaluators. This header carries its own
+// definitions (and the stb_ds implementation), so include it from exactly one
+// translation unit per program.
+#ifndef LAMBDA_H
+#define LAMBDA_H
+
+#include "string.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpp_magic.h"
+#include "trace.h"
+
+// Counters kept by every engine and reported by --stats. They are plain
+// increments on the hot paths, so they are always on.
+typedef enum { PHASE_LOAD, PHASE_EVAL, PHASE_PRINT, PHASE_COUNT } Phase;
+
+typedef struct {
+  uint64_t beta;          // beta reductions
+  uint64_t lookups;       // variable lookups
+  uint64_t max_depth;     // deepest evaluation stack
+  uint64_t nodes;         // nodes built by new_*
+  uint64_t realloc_bytes; // bytes requested from realloc by stb_ds
+  uint64_t gc_count;      // collections, minor and major
+  uint64_t gc_reclaimed;  // bytes of dead nodes dropped by collections
+  uint64_t cache_hits;    // results found in the result cache
+  uint64_t cache_misses;
+  double gc_pause;        // total time spent collecting
+  double gc_max_pause;
+  double time[PHASE_COUNT];
+} Stats;
+
+// Per thread; parallel normalization and batch evaluation merge the workers'
+// counts.
+_Thread_local Stats stats = {0};
+
+static inline void stats_depth(uint64_t depth) {
+  if (depth > stats.max_depth)
+    stats.max_depth = depth;
+}
+
+static void *stats_realloc(void *ptr, size_t size) {
+  stats.realloc_bytes += size;
+  return realloc(ptr, size);
+}
+
+// Add another thread's counts to this thread's.
+void stats_merge(const Stats *from) {
+  stats.beta += from->beta;
+  stats.lookups += from->lookups;
+  stats.nodes += from->nodes;
+  stats.realloc_bytes += from->realloc_bytes;
+  stats.cache_hits += from->cache_hits;
+  stats.cache_misses += from->cache_misses;
+  stats_depth(from->max_depth);
+  for (int i = 0; i < PHASE_COUNT; i++)
+    stats.time[i] += from->time[i];
+}
+
+double stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define STBDS_REALLOC(context, ptr, size) stats_realloc((ptr), (size))
+#define STBDS_FREE(context, ptr) free(ptr)
+#define STBDS_THREAD_LOCAL _Thread_local
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+
+#ifndef TRACE
+#define TRACE 1
+#endif
+
+// Build with -DEXPR_HASH=1 to give every node a structural hash, computed as
+// it is built. It costs 8 bytes per node and makes most expr_equal calls
+// between different terms O(1).
+#ifndef EXPR_HASH
+#define EXPR_HASH 0
+#endif
+
+typedef unsigned int Variable;
+typedef struct Abstraction Abstraction;
+typedef struct Application Application;
+typedef struct Expr Expr;
+
+struct Abstraction {
+  Expr *body;
+};
+
+struct Application {
+  Expr *func;
+  Expr *arg;
+};
+
+typedef enum { EXPR_VAR, EXPR_ABS, EXPR_APP } ExprType;
+
+typedef struct Expr {
+  ExprType type;
+  uint32_t refs; // references held on this node, with --refcount
+#if EXPR_HASH
+  uint64_t hash; // see expr_hash
+#endif
+  union {
+    Variable var;
+    Abstraction abs;
+    Application app;
+  };
+} Expr;
+
+typedef struct Env Env;
+
+typedef struct {
+  Expr *term;
+  Env *env;
+} Closure;
+
+// Environments are immutable linked lists: extending one shares its tail with
+// every closure that captured it.
+struct Env {
+  Closure clo;
+  Env *next;
+};
+
+// Continuation frames. In the CEK machine, FRAME_FUNC holds an application's
+// function, still to be evaluated once its argument is a value; FRAME_CALL
+// holds that argument value while the function is being evaluated. The lazy
+// machine pushes unevaluated arguments as FRAME_ARG and marks a thunk being
+// forced with FRAME_UPDATE, whose clo.env is the environment cell to update.
+typedef enum { FRAME_FUNC, FRAME_CALL, FRAME_ARG, FRAME_UPDATE } FrameType;
+
+typedef struct {
+  FrameType type;
+  Closure clo;
+} Frame;
+
+typedef Frame *Stack;
+
+#define ERROR(msg, ...)                                                        \
+  {                                                                            \
+    fprintf(stderr, "Error: " msg "\n", ##__VA_ARGS__);                        \
+    exit(EXIT_FAILURE);                                                        \
+  }                                                                            \
+  while (0)
+
+#define CHECK_NULL_ARGS_(var) !(var)
+#define OR_OP() ||
+#define CHECK_NULL_ARGS(...)                                                   \
+  if (EVAL(MAP(CHECK_NULL_ARGS_, OR_OP, __VA_ARGS__)))                         \
+    ERROR("NULL argument(s) passed to function");
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGN sizeof(void *)
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct Arena Arena;
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+// Region allocator: hands out memory from large chunks and releases it all at
+// once. Reset chunks are kept on a free list and reused by later allocations.
+struct Arena {
+  ArenaChunk *head;
+  ArenaChunk *free;
+};
+
+static ArenaChunk *arena_grow(Arena *a, size_t size) {
+  ArenaChunk *c = a->free;
+  if (c && c->size >= size) {
+    a->free = c->next;
+  } else {
+    size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    c = malloc(sizeof(ArenaChunk) + cap);
+    if (!c)
+      ERROR("Memory allocation failed");
+    c->size = cap;
+  }
+  c->used = 0;
+  c->next = a->head;
+  a->head = c;
+  return c;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  ArenaChunk *c = a->head;
+  if (!c || c->size - c->used < size)
+    c = arena_grow(a, size);
+  void *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+// Drop every allocation but keep the chunks around for reuse.
+void arena_reset(Arena *a) {
+  while (a->head) {
+    ArenaChunk *c = a->head;
+    a->head = c->next;
+    c->next = a->free;
+    a->free = c;
+  }
+}
+
+// Bytes handed out since the last reset.
+size_t arena_used(const Arena *a) {
+  size_t n = 0;
+  for (const ArenaChunk *c = a->head; c; c = c->next)
+    n += c->used;
+  return n;
+}
+
+// Hand every chunk of `src` over to `dst`, behind the chunk `dst` is
+// currently filling, so that they are released together.
+void arena_adopt(Arena *dst, Arena *src) {
+  while (src->head) {
+    ArenaChunk *c = src->head;
+    src->head = c->next;
+    if (dst->head) {
+      c->next = dst->head->next;
+      dst->head->next = c;
+    } else {
+      c->next = NULL;
+      dst->head = c;
+    }
+  }
+  while (src->free) {
+    ArenaChunk *c = src->free;
+    src->free = c->next;
+    c->next = dst->free;
+    dst->free = c;
+  }
+}
+
+// Return all memory held by the arena to the system.
+void arena_free(Arena *a) {
+  arena_reset(a);
+  while (a->free) {
+    ArenaChunk *c = a->free;
+    a->free = c->next;
+    free(c);
+  }
+}
+
+Arena expr_arena = {0};
+// Scratch memory of the evaluators (environments), which never outlives one
+// evaluation. Every thread has its own.
+_Thread_local Arena eval_arena = {0};
+
+// Opt-in reference counting: a node counts its parents plus every explicit
+// expr_retain, and goes back to a free list once that drops to zero. New nodes
+// start out unowned, so whoever keeps one must retain it. A node that is never
+// retained is never released either: it stays in its arena until expr_reset,
+// and with --hash-cons in the table until expr_sweep.
+bool refcount = false;
+Expr *expr_free_list = NULL; // linked through abs.body
+Expr **release_todo = NULL;
+
+// Opt-in tracing collection (--gc): new nodes are bump-allocated in a nursery,
+// and collections copy the reachable ones into an old generation. Terms are
+// immutable, so old nodes never point into the nursery and minor collections
+// need no remembered set. Spaces are large reservations that only take memory
+// as they fill up. Under a limit on address space (ulimit -v) they are sized
+// to fit in part of it, and smaller ones are tried if a reservation fails.
+typedef struct {
+  char *base;
+  char *top;
+  char *end;
+} GcSpace;
+
+#define GC_NURSERY_RESERVE ((size_t)1 << 30)
+#define GC_OLD_RESERVE ((size_t)1 << 33)
+#define GC_MIN_RESERVE ((size_t)1 << 20)
+
+bool gc = false;
+GcSpace gc_nursery, gc_old, gc_spare;
+size_t gc_nursery_limit = 8 << 20;
+size_t gc_old_limit = 64 << 20;
+
+// Reserve up to `size` bytes, halving the request while it is refused.
+static size_t gc_space_init(GcSpace *s, size_t size) {
+  for (;;) {
+    s->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s->base != MAP_FAILED)
+      break;
+    if (size / 2 < GC_MIN_RESERVE)
+      ERROR("Cannot reserve %zu bytes for the collector", size);
+    size /= 2;
+  }
+  s->top = s->base;
+  s->end = s->base + size;
+  return size;
+}
+
+// Reserve the three spaces, leaving at least half of any address space limit
+// to the rest of the program, and fit the collection thresholds to them.
+static void gc_init(void) {
+  size_t nursery = GC_NURSERY_RESERVE, old = GC_OLD_RESERVE;
+  struct rlimit limit;
+  if (!getrlimit(RLIMIT_AS, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+    if (nursery > limit.rlim_cur / 8)
+      nursery = limit.rlim_cur / 8;
+    if (old > limit.rlim_cur / 6)
+      old = limit.rlim_cur / 6;
+  }
+  nursery = gc_space_init(&gc_nursery, nursery);
+  old = gc_space_init(&gc_old, old);
+  // A major collection copies the old generation into the spare space and
+  // swaps them, so both must be the same size.
+  size_t spare = gc_space_init(&gc_spare, old);
+  if (spare < old) {
+    munmap(gc_old.base, old);
+    gc_space_init(&gc_old, spare);
+  }
+  if (gc_nursery_limit > nursery / 2)
+    gc_nursery_limit = nursery / 2;
+  if (gc_old_limit > spare / 2)
+    gc_old_limit = spare / 2;
+}
+
+static inline bool gc_space_has(const GcSpace *s, const void *p) {
+  return (const char *)p >= s->base && (const char *)p < s->top;
+}
+
+static inline Expr *gc_space_alloc(GcSpace *s) {
+  if (s->end - s->top < (ptrdiff_t)sizeof(Expr))
+    ERROR("Collector space exhausted");
+  Expr *e = (Expr *)s->top;
+  s->top += sizeof(Expr);
+  return e;
+}
+
+// Empty a space and give its pages back to the system.
+static void gc_space_clear(GcSpace *s) {
+  if (s->top > s->base)
+    madvise(s->base, s->top - s->base, MADV_DONTNEED);
+  s->top = s->base;
+}
+
+// Where this thread allocates nodes; worker threads have arenas of their own.
+static _Thread_local Arena *node_arena = &expr_arena;
+
+static Expr *expr_alloc(void) {
+  if (gc) {
+    if (!gc_nursery.base)
+      gc_init();
+    return gc_space_alloc(&gc_nursery);
+  }
+  Expr *e = expr_free_list;
+  if (!e)
+    return arena_alloc(node_arena, sizeof(Expr));
+  expr_free_list = e->abs.body;
+  return e;
+}
+
+static inline Expr *expr_retain(Expr *e) {
+  if (refcount)
+    e->refs++;
+  return e;
+}
+
+#define NEW_EXPR expr_alloc()
+
+// Merkle hashing: a node's hash mixes its type with its variable or the hashes
+// of its children. De Bruijn terms have no names, so alpha-equivalent terms
+// hash alike.
+static inline uint64_t expr_mix(uint64_t h, uint64_t v) {
+  h = (h ^ v) * 0x9e3779b97f4a7c15;
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  return h ^ h >> 31;
+}
+
+#if EXPR_HASH
+#define EXPR_SET_HASH(e, h) ((e)->hash = (h))
+#else
+#define EXPR_SET_HASH(e, h) ((void)0)
+#endif
+
+// Hash-consing: when enabled, structurally equal nodes are built only once, so
+// pointer equality coincides with alpha-equivalence. Enable it before building
+// any term that will be compared.
+typedef struct {
+  uintptr_t type;
+  uintptr_t a;
+  uintptr_t b;
+} ExprKey;
+
+bool hash_cons = false;
+struct {
+  ExprKey key;
+  Expr *value;
+} *expr_table = NULL;
+
+#define EXPR_KEY(tag, a, b) {(tag), (uintptr_t)(a), (uintptr_t)(b)}
+#define NEW_EXPR_IMPL(check, key_, initialize)                                 \
+  {                                                                            \
+    CHECK_NULL_ARGS check;                                                     \
+    ExprKey key = EXPR_KEY key_;                                               \
+    if (hash_cons) {                                                           \
+      Expr *found = hmget(expr_table, key);                                    \
+      if (found)                                                               \
+        return found;                                                          \
+    }                                                                          \
+    Expr *e = NEW_EXPR;                                                        \
+    stats.nodes++;                                                             \
+    e->type = key.type;                                                        \
+    e->refs = 0;                                                               \
+    initialize;                                                                \
+    if (hash_cons)                                                             \
+      hmput(expr_table, key, e);                                               \
+    return e;                                                                  \
+  }
+
+Expr *new_abs(Expr *body) NEW_EXPR_IMPL((body), (EXPR_ABS, body, 0), {
+  e->abs.body = expr_retain(body);
+  EXPR_SET_HASH(e, expr_mix(EXPR_ABS, body->hash));
+});
+
+Expr *new_app(Expr *func, Expr *arg)
+    NEW_EXPR_IMPL((func, arg), (EXPR_APP, func, arg), {
+      e->app.func = expr_retain(func);
+      e->app.arg = expr_retain(arg);
+      EXPR_SET_HASH(e, expr_mix(expr_mix(EXPR_APP, func->hash), arg->hash));
+    });
+
+Expr *new_var(Variable var) NEW_EXPR_IMPL((var), (EXPR_VAR, var, 0), {
+  e->var = var;
+  EXPR_SET_HASH(e, expr_mix(EXPR_VAR, var));
+});
+
+#undef NEW_EXPR_IMPL
+#undef EXPR_KEY
+#undef EXPR_SET_HASH
+#undef NEW_EXPR
+#undef CHECK_NULL_ARGS
+#undef CHECK_NULL_ARGS_
+
+// The hash-consing key under which `e` was built.
+static ExprKey expr_key(const Expr *e) {
+  switch (e->type) {
+  case EXPR_VAR:
+    return (ExprKey){EXPR_VAR, e->var, 0};
+  case EXPR_ABS:
+    return (ExprKey){EXPR_ABS, (uintptr_t)e->abs.body, 0};
+  case EXPR_APP:
+    return (ExprKey){EXPR_APP, (uintptr_t)e->app.func, (uintptr_t)e->app.arg};
+  }
+  ERROR("Unknown expression type %d", e->type);
+}
+
+// Drop one reference to `e`. Nodes that become unreferenced are put on the
+// free list and their children released in turn, without recursion.
+void expr_release(Expr *e) {
+  if (!refcount)
+    return;
+  arrput(release_todo, e);
+  while (arrlen(release_todo) > 0) {
+    e = arrpop(release_todo);
+    if (e->refs == 0)
+      ERROR("Released a node that holds no references");
+    if (--e->refs > 0)
+      continue;
+
+    if (hash_cons)
+      (void)hmdel(expr_table, expr_key(e));
+    if (e->type == EXPR_ABS) {
+      arrput(release_todo, e->abs.body);
+    } else if (e->type == EXPR_APP) {
+      arrput(release_todo, e->app.func);
+      arrput(release_todo, e->app.arg);
+    }
+
+    e->abs.body = expr_free_list;
+    expr_free_list = e;
+  }
+}
+
+// Free the hash-consed nodes that nothing holds: intermediate ones built and
+// dropped without a retain. Only call this when every node still in use has
+// been retained.
+void expr_sweep(void) {
+  if (!refcount || !hash_cons)
+    return;
+  // Unheld nodes are nobody's children, so releasing one frees none of the
+  // others; gather them first, as releasing reshuffles the table.
+  Expr **unheld = NULL;
+  for (ptrdiff_t i = 0; i < hmlen(expr_table); i++)
+    if (expr_table[i].value->refs == 0)
+      arrput(unheld, expr_table[i].value);
+  for (ptrdiff_t i = 0; i < arrlen(unheld); i++)
+    expr_release(expr_retain(unheld[i]));
+  arrfree(unheld);
+}
+
+// Collector roots. A root is an stb_ds array whose elements hold an Expr * at
+// `offset`, or a single Expr * when `stride` is 0. `array` is the address of
+// the variable holding the array, which moves as it grows. NULL entries are
+// skipped.
+typedef struct {
+  void *array;
+  size_t stride;
+  size_t offset;
+} GcRoot;
+
+GcRoot *gc_roots = NULL;
+
+// Marks a collected node whose copy is in abs.body; never seen outside the
+// collector.
+#define EXPR_FORWARDED ((ExprType)3)
+
+// Roots are only recorded with --gc, so that other threads never touch the
+// list.
+void gc_root(void *array, size_t stride, size_t offset) {
+  if (gc)
+    arrput(gc_roots, ((GcRoot){array, stride, offset}));
+}
+
+// Remove the `n` most recently added roots.
+void gc_unroot(size_t n) {
+  if (gc)
+    arrsetlen(gc_roots, arrlenu(gc_roots) - n);
+}
+
+static inline bool gc_due(void) {
+  return gc && (size_t)(gc_nursery.top - gc_nursery.base) >= gc_nursery_limit;
+}
+
+static inline bool gc_collected(const Expr *e, bool major) {
+  return gc_space_has(&gc_nursery, e) || (major && gc_space_has(&gc_old, e));
+}
+
+static Expr *gc_forward(Expr *e, bool major) {
+  if (!gc_collected(e, major))
+    return e;
+  if (e->type == EXPR_FORWARDED)
+    return e->abs.body;
+  Expr *copy = gc_space_alloc(major ? &gc_spare : &gc_old);
+  *copy = *e;
+  e->type = EXPR_FORWARDED;
+  e->abs.body = copy;
+  return copy;
+}
+
+// Cheney copy of everything reachable from the roots out of the nursery (and
+// the old generation, if `major`) into the next space.
+static void gc_copy(bool major) {
+  GcSpace *to = major ? &gc_spare : &gc_old;
+  size_t before = (gc_nursery.top - gc_nursery.base) +
+                  (major ? gc_old.top - gc_old.base : 0);
+  char *scan = to->top, *start = to->top;
+
+  for (ptrdiff_t i = 0; i < arrlen(gc_roots); i++) {
+    GcRoot r = gc_roots[i];
+    if (!r.stride) {
+      Expr **slot = r.array;
+      if (*slot)
+        *slot = gc_forward(*slot, major);
+      continue;
+    }
+    char *a = *(char **)r.array;
+    for (size_t j = 0, n = a ? arrlenu(a) : 0; j < n; j++) {
+      Expr **slot = (Expr **)(a + j * r.stride + r.offset);
+      if (*slot)
+        *slot = gc_forward(*slot, major);
+    }
+  }
+
+  for (; scan < to->top; scan += sizeof(Expr)) {
+    Expr *e = (Expr *)scan;
+    if (e->type == EXPR_ABS) {
+      e->abs.body = gc_forward(e->abs.body, major);
+    } else if (e->type == EXPR_APP) {
+      e->app.func = gc_forward(e->app.func, major);
+      e->app.arg = gc_forward(e->app.arg, major);
+    }
+  }
+
+  // The hash-consing table holds its nodes weakly: dead ones are dropped and
+  // moved ones re-keyed on their moved children.
+  if (hash_cons) {
+    typeof(expr_table) table = NULL;
+    for (ptrdiff_t i = 0; i < hmlen(expr_table); i++) {
+      Expr *e = expr_table[i].value;
+      if (gc_collected(e, major)) {
+        if (e->type != EXPR_FORWARDED)
+          continue;
+        e = e->abs.body;
+      }
+      hmput(table, expr_key(e), e);
+    }
+    hmfree(expr_table);
+    expr_table = table;
+  }
+
+  stats.gc_reclaimed += before - (to->top - start);
+
+  // Keep the nursery's pages for the next round, up to its usual size.
+  if ((size_t)(gc_nursery.top - gc_nursery.base) > gc_nursery_limit)
+    madvise(gc_nursery.base + gc_nursery_limit,
+            gc_nursery.top - gc_nursery.base - gc_nursery_limit,
+            MADV_DONTNEED);
+  gc_nursery.top = gc_nursery.base;
+  if (major) {
+    gc_space_clear(&gc_old);
+    GcSpace old = gc_old;
+    gc_old = gc_spare;
+    gc_spare = old;
+  }
+}
+
+// Collect the nursery, and the old generation too once it has doubled since
+// its last collection. Only call this at a safepoint: every node still in use
+// must be reachable from gc_roots. Code compiled by the JIT refers to nodes by
+// address, so it has to be dropped first.
+void gc_collect(void) {
+  double start = stats_clock();
+  gc_copy(false);
+  stats.gc_count++;
+  if ((size_t)(gc_old.top - gc_old.base) > gc_old_limit) {
+    gc_copy(true);
+    stats.gc_count++;
+    size_t live = 2 * (gc_old.top - gc_old.base);
+    gc_old_limit = live > gc_old_limit ? live : gc_old_limit;
+  }
+  double pause = stats_clock() - start;
+  stats.gc_pause += pause;
+  if (pause > stats.gc_max_pause)
+    stats.gc_max_pause = pause;
+}
+
+// Release every node built so far, together with the hash-consing table that
+// points into them and any environment referring to them.
+void expr_reset(void) {
+  hmfree(expr_table);
+  arrfree(release_todo);
+  expr_free_list = NULL;
+  gc_space_clear(&gc_nursery);
+  gc_space_clear(&gc_old);
+  arena_reset(&expr_arena);
+  arena_reset(&eval_arena);
+}
+
+// Structural hash of `expr`, equal for alpha-equivalent terms. Stored in the
+// node with EXPR_HASH; otherwise computed by a walk over the term, which
+// visits shared subterms once per path to them.
+uint64_t expr_hash(const Expr *expr) {
+#if EXPR_HASH
+  return expr->hash;
+#else
+  typedef struct {
+    const Expr *expr;
+    bool done; // children hashed, on top of `hashes`
+  } HashTask;
+
+  HashTask *todo = NULL;
+  uint64_t *hashes = NULL;
+  arrput(todo, ((HashTask){expr, false}));
+  while (arrlen(todo) > 0) {
+    HashTask t = arrpop(todo);
+    const Expr *e = t.expr;
+    if (e->type == EXPR_VAR) {
+      arrput(hashes, expr_mix(EXPR_VAR, e->var));
+    } else if (!t.done) {
+      arrput(todo, ((HashTask){e, true}));
+      if (e->type == EXPR_ABS) {
+        arrput(todo, ((HashTask){e->abs.body, false}));
+      } else {
+        arrput(todo, ((HashTask){e->app.arg, false}));
+        arrput(todo, ((HashTask){e->app.func, false}));
+      }
+    } else if (e->type == EXPR_ABS) {
+      arrlast(hashes) = expr_mix(EXPR_ABS, arrlast(hashes));
+    } else {
+      uint64_t arg = arrpop(hashes);
+      arrlast(hashes) = expr_mix(expr_mix(EXPR_APP, arrlast(hashes)), arg);
+    }
+  }
+  uint64_t h = hashes[0];
+  arrfree(todo);
+  arrfree(hashes);
+  return h;
+#endif
+}
+
+// Alpha-equivalence. With EXPR_HASH, terms whose hashes differ are told apart
+// without a walk; equal hashes are still confirmed structurally, pair by pair
+// from an explicit stack.
+bool expr_equal(const Expr *a, const Expr *b) {
+  typedef struct {
+    const Expr *a, *b;
+  } EqualTask;
+
+  if (a == b)
+    return true;
+  if (hash_cons || a->type != b->type)
+    return false;
+#if EXPR_HASH
+  if (a->hash != b->hash)
+    return false;
+#endif
+
+  EqualTask *todo = NULL;
+  bool equal = true;
+  arrput(todo, ((EqualTask){a, b}));
+  while (equal && arrlen(todo) > 0) {
+    EqualTask t = arrpop(todo);
+    if (t.a == t.b)
+      continue;
+    if (t.a->type != t.b->type) {
+      equal = false;
+      break;
+    }
+#if EXPR_HASH
+    if (t.a->hash != t.b->hash) {
+      equal = false;
+      break;
+    }
+#endif
+    switch (t.a->type) {
+    case EXPR_VAR:
+      equal = t.a->var == t.b->var;
+      break;
+    case EXPR_ABS:
+      arrput(todo, ((EqualTask){t.a->abs.body, t.b->abs.body}));
+      break;
+    case EXPR_APP:
+      arrput(todo, ((EqualTask){t.a->app.arg, t.b->app.arg}));
+      arrput(todo, ((EqualTask){t.a->app.func, t.b->app.func}));
+      break;
+    }
+  }
+  arrfree(todo);
+  return equal;
+}
+
+// Output buffer for serialized terms. With a file descriptor it is written out
+// in large chunks as it fills up; with fd < 0 it just grows in memory.
+#define WRITER_CHUNK (1 << 16)
+
+typedef struct {
+  char *buf; // stb_ds array
+  int fd;
+} Writer;
+
+Writer writer_fd(int fd) { return (Writer){NULL, fd}; }
+
+Writer writer_mem(void) { return (Writer){NULL, -1}; }
+
+void writer_flush(Writer *w) {
+  if (w->fd < 0)
+    return;
+  // Keep ordering with anything printed through stdio.
+  if (w->fd == STDOUT_FILENO)
+    fflush(stdout);
+  for (size_t off = 0, len = arrlenu(w->buf); off < len;) {
+    ssize_t n = write(w->fd, w->buf + off, len - off);
+    if (n < 0)
+      ERROR("Write failed");
+    off += n;
+  }
+  arrsetlen(w->buf, 0);
+}
+
+void writer_free(Writer *w) {
+  writer_flush(w);
+  arrfree(w->buf);
+}
+
+static inline void writer_put(Writer *w, const char *s, size_t n) {
+  memcpy(arraddnptr(w->buf, n), s, n);
+  if (w->fd >= 0 && arrlenu(w->buf) >= WRITER_CHUNK)
+    writer_flush(w);
+}
+
+static inline void writer_putc(Writer *w, char c) {
+  arrput(w->buf, c);
+  if (w->fd >= 0 && arrlenu(w->buf) >= WRITER_CHUNK)
+    writer_flush(w);
+}
+
+// Format two digits at a time from a lookup table.
+static void writer_u32(Writer *w, uint32_t v) {
+  static const char digits[] = "00010203040506070809"
+                               "10111213141516171819"
+                               "20212223242526272829"
+                               "30313233343536373839"
+                               "40414243444546474849"
+                               "50515253545556575859"
+                               "60616263646566676869"
+                               "70717273747576777879"
+                               "80818283848586878889"
+                               "90919293949596979899";
+  char tmp[10];
+  char *p = tmp + sizeof(tmp);
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, digits + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, digits + 2 * v, 2);
+  } else {
+    *--p = '0' + v;
+  }
+  writer_put(w, p, tmp + sizeof(tmp) - p);
+}
+
+// Serialize a term. Pending subterms and closing punctuation are kept on an
+// explicit stack (`expr == NULL` entries write `c`), so depth is unbounded.
+void write_expr(Writer *w, const Expr *expr) {
+  typedef struct {
+    const Expr *expr;
+    char c;
+  } Item;
+
+  if (!expr)
+    ERROR("NULL expression");
+
+  Item *todo = NULL;
+  arrput(todo, ((Item){expr, 0}));
+  while (arrlen(todo) > 0) {
+    Item it = arrpop(todo);
+    if (!it.expr) {
+      writer_putc(w, it.c);
+      continue;
+    }
+
+    switch (it.expr->type) {
+    case EXPR_VAR:
+      writer_u32(w, it.expr->var);
+      break;
+    case EXPR_ABS:
+      writer_put(w, "(λ ", sizeof("(λ ") - 1);
+      arrput(todo, ((Item){NULL, ')'}));
+      arrput(todo, ((Item){it.expr->abs.body, 0}));
+      break;
+    case EXPR_APP:
+      writer_putc(w, '(');
+      arrput(todo, ((Item){NULL, ')'}));
+      arrput(todo, ((Item){it.expr->app.arg, 0}));
+      arrput(todo, ((Item){NULL, ' '}));
+      arrput(todo, ((Item){it.expr->app.func, 0}));
+      break;
+    }
+  }
+  arrfree(todo);
+}
+
+void _print_expr(const Expr *expr) {
+  Writer w = writer_fd(STDOUT_FILENO);
+  write_expr(&w, expr);
+  writer_free(&w);
+}
+
+#define print_expr(expr)                                                       \
+  {                                                                            \
+    Writer w_ = writer_fd(STDOUT_FILENO);                                      \
+    write_expr(&w_, (expr));                                                   \
+    writer_putc(&w_, '\n');                                                    \
+    writer_free(&w_);                                                          \
+  }                                                                            \
+  while (0)
+
+// Parser for the syntax written by _print_expr: `(λ body)`, `(func arg)` and
+// positive de Bruijn indices, with `\` accepted as an ASCII alias for `λ`.
+// Applications may list more than one argument and associate to the left.
+// The input is scanned in place and never copied or NUL-terminated.
+typedef struct {
+  const char *p;
+  const char *begin;
+  const char *end;
+} Parser;
+
+#define PARSE_ERROR(ps, msg, ...)                                              \
+  ERROR("Parse error at byte %td: " msg, (ps)->p - (ps)->begin, ##__VA_ARGS__)
+
+static void skip_space(Parser *ps) {
+  while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t' ||
+                             *ps->p == '\n' || *ps->p == '\r'))
+    ps->p++;
+}
+
+// Parse one term, or return NULL at end of input. Nesting is tracked on an
+// explicit stack, so arbitrarily deep terms are fine.
+Expr *parse_expr(Parser *ps) {
+  typedef struct {
+    bool abs;
+    Expr *func;
+  } Open;
+
+  Open *open = NULL;
+  Expr *val;
+
+  skip_space(ps);
+  if (ps->p == ps->end)
+    return NULL;
+
+  for (;;) {
+    skip_space(ps);
+    if (ps->p == ps->end)
+      PARSE_ERROR(ps, "unexpected end of input");
+
+    char c = *ps->p;
+    if (c == '(') {
+      ps->p++;
+      skip_space(ps);
+      bool abs = false;
+      if (ps->p < ps->end && *ps->p == '\\') {
+        ps->p++;
+        abs = true;
+      } else if (ps->end - ps->p >= 2 && !memcmp(ps->p, "λ", 2)) {
+        ps->p += 2;
+        abs = true;
+      }
+      arrput(open, ((Open){abs, NULL}));
+      continue;
+    }
+
+    if (c >= '0' && c <= '9') {
+      uint64_t n = 0;
+      while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        n = n * 10 + (*ps->p++ - '0');
+        if (n > UINT32_MAX)
+          PARSE_ERROR(ps, "variable index too large");
+      }
+      if (n == 0)
+        PARSE_ERROR(ps, "variable indices start at 1");
+      val = new_var((Variable)n);
+    } else {
+      PARSE_ERROR(ps, "unexpected character '%c'", c);
+    }
+
+    // Hand the finished term to the enclosing parentheses, closing as many as
+    // are complete.
+    while (arrlen(open) > 0) {
+      Open *top = &arrlast(open);
+      if (!top->abs) {
+        top->func = top->func ? new_app(top->func, val) : val;
+        skip_space(ps);
+        if (ps->p == ps->end || *ps->p != ')')
+          break;
+        val = top->func;
+      }
+      skip_space(ps);
+      if (ps->p == ps->end || *ps->p != ')')
+        PARSE_ERROR(ps, "expected ')'");
+      ps->p++;
+      if (top->abs)
+        val = new_abs(val);
+      arrsetlen(open, arrlen(open) - 1);
+    }
+
+    if (arrlen(open) == 0) {
+      arrfree(open);
+      return val;
+    }
+  }
+}
+
+#undef PARSE_ERROR
+
+typedef struct {
+  const char *data;
+  size_t size;
+  bool mapped;
+} Source;
+
+// Map a file into memory, or read it whole when it can't be mapped (pipes,
+// "-" for stdin).
+Source source_open(const char *path) {
+  int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0)
+    ERROR("Cannot open %s", path);
+
+  Source src = {0};
+  struct stat st;
+  if (fd != STDIN_FILENO && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+    src.size = st.st_size;
+    if (src.size == 0) {
+      close(fd);
+      return src;
+    }
+    void *data = mmap(NULL, src.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, src.size, MADV_SEQUENTIAL);
+      close(fd);
+      src.data = data;
+      src.mapped = true;
+      return src;
+    }
+  }
+
+  char *buf = NULL;
+  size_t cap = 0;
+  for (ssize_t n;; src.size += n) {
+    if (cap - src.size < 65536) {
+      cap = cap ? 2 * cap : 1 << 20;
+      if (!(buf = realloc(buf, cap)))
+        ERROR("Memory allocation failed");
+    }
+    if ((n = read(fd, buf + src.size, cap - src.size)) <= 0)
+      break;
+  }
+  if (fd != STDIN_FILENO)
+    close(fd);
+  src.data = buf;
+  return src;
+}
+
+void source_close(Source *src) {
+  if (src->mapped)
+    munmap((void *)src->data, src->size);
+  else
+    free((void *)src->data);
+}
+
+// Parse every term in a file into an stb_ds array.
+Expr **parse_file(const char *path) {
+  Source src = source_open(path);
+  Parser ps = {src.data, src.data, src.data + src.size};
+  Expr **terms = NULL;
+  for (Expr *e; (e = parse_expr(&ps));)
+    arrput(terms, e);
+  source_close(&src);
+  return terms;
+}
+
+// Named front end: `\x. \y. x y` (or `λx y. x y`). Application is
+// juxtaposition and associates to the left, and a lambda body extends as far
+// right as possible. A term ends at `;`, at the end of the input, or at a
+// newline outside parentheses. Names resolve to de Bruijn indices through a
+// string hash map from each name to the level of its innermost binder; the
+// bindings a lambda shadows are restored on the way out.
+typedef struct {
+  char *key;
+  Variable value; // binder level, 0 when unbound
+} Scope;
+
+typedef struct {
+  Parser ps;
+  Scope *scope;
+  ptrdiff_t *bound; // scope entries bound by enclosing binders, innermost last
+  Variable *saved;  // previous level of each entry in `bound`
+  char *name;       // NUL-terminated copy of the identifier being resolved
+  int parens;
+} NamedParser;
+
+#define NAMED_ERROR(np, msg, ...)                                              \
+  ERROR("Parse error at byte %td: " msg, (np)->ps.p - (np)->ps.begin,          \
+        ##__VA_ARGS__)
+
+static bool is_ident(char c, bool first) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+         (!first && ((c >= '0' && c <= '9') || c == '\''));
+}
+
+static void named_skip_space(NamedParser *np) {
+  for (Parser *ps = &np->ps; ps->p < ps->end; ps->p++) {
+    char c = *ps->p;
+    if (c != ' ' && c != '\t' && c != '\r' && (c != '\n' || !np->parens))
+      break;
+  }
+}
+
+static ptrdiff_t named_ident(NamedParser *np) {
+  Parser *ps = &np->ps;
+  const char *start = ps->p;
+  while (ps->p < ps->end && is_ident(*ps->p, ps->p == start))
+    ps->p++;
+  if (ps->p == start)
+    NAMED_ERROR(np, "expected a name");
+
+  arrsetlen(np->name, ps->p - start + 1);
+  memcpy(np->name, start, ps->p - start);
+  np->name[ps->p - start] = '\0';
+
+  ptrdiff_t i = shgeti(np->scope, np->name);
+  if (i < 0) {
+    shput(np->scope, np->name, 0);
+    i = shgeti(np->scope, np->name);
+  }
+  return i;
+}
+
+static bool named_lambda(NamedParser *np) {
+  Parser *ps = &np->ps;
+  if (ps->p < ps->end && *ps->p == '\\') {
+    ps->p++;
+    return true;
+  }
+  if (ps->end - ps->p >= 2 && !memcmp(ps->p, "λ", 2)) {
+    ps->p += 2;
+    return true;
+  }
+  return false;
+}
+
+static bool named_term_end(NamedParser *np) {
+  Parser *ps = &np->ps;
+  return ps->p == ps->end || *ps->p == ')' || *ps->p == ';' || *ps->p == '\n';
+}
+
+static void named_binders(NamedParser *np) {
+  Parser *ps = &np->ps;
+  named_skip_space(np);
+  while (named_lambda(np)) {
+    for (named_skip_space(np); ps->p < ps->end && *ps->p != '.';
+         named_skip_space(np)) {
+      ptrdiff_t i = named_ident(np);
+      arrput(np->bound, i);
+      arrput(np->saved, np->scope[i].value);
+      np->scope[i].value = arrlen(np->bound);
+    }
+    if (ps->p == ps->end)
+      NAMED_ERROR(np, "expected '.'");
+    ps->p++;
+    named_skip_space(np);
+  }
+}
+
+// Terms nested in parentheses or in argument position are tracked on an
+// explicit stack of frames, each holding the application built so far and
+// the binders it opened.
+static Expr *_parse_named(NamedParser *np) {
+  typedef struct {
+    Expr *res;
+    ptrdiff_t outer;
+    bool paren;
+  } Frame;
+
+  Parser *ps = &np->ps;
+  Frame *frames = NULL;
+  arrput(frames, ((Frame){NULL, arrlen(np->bound), false}));
+  named_binders(np);
+
+  for (;;) {
+    named_skip_space(np);
+    if (named_term_end(np)) {
+      Frame f = arrpop(frames);
+      if (!f.res)
+        NAMED_ERROR(np, "expected a term");
+      while (arrlen(np->bound) > f.outer) {
+        np->scope[arrpop(np->bound)].value = arrpop(np->saved);
+        f.res = new_abs(f.res);
+      }
+      if (f.paren) {
+        if (ps->p == ps->end || *ps->p != ')')
+          NAMED_ERROR(np, "expected ')'");
+        ps->p++;
+        np->parens--;
+      }
+      if (arrlen(frames) == 0) {
+        arrfree(frames);
+        return f.res;
+      }
+      Frame *top = &arrlast(frames);
+      top->res = top->res ? new_app(top->res, f.res) : f.res;
+      continue;
+    }
+
+    if (*ps->p == '(' || *ps->p == '\\' || *ps->p == *"λ") {
+      bool paren = *ps->p == '(';
+      if (paren) {
+        ps->p++;
+        np->parens++;
+      }
+      arrput(frames, ((Frame){NULL, arrlen(np->bound), paren}));
+      named_binders(np);
+      continue;
+    }
+
+    ptrdiff_t i = named_ident(np);
+    if (!np->scope[i].value)
+      NAMED_ERROR(np, "unbound variable '%s'", np->scope[i].key);
+    Expr *var = new_var(arrlen(np->bound) - np->scope[i].value + 1);
+    Frame *top = &arrlast(frames);
+    top->res = top->res ? new_app(top->res, var) : var;
+  }
+}
+
+// Parse the next named term, or return NULL at end of input.
+Expr *parse_named(NamedParser *np) {
+  Parser *ps = &np->ps;
+  for (; ps->p < ps->end; ps->p++) {
+    char c = *ps->p;
+    if (c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != ';')
+      break;
+  }
+  if (ps->p == ps->end)
+    return NULL;
+
+  Expr *res = _parse_named(np);
+  if (ps->p < ps->end && *ps->p == ')')
+    NAMED_ERROR(np, "unbalanced ')'");
+  return res;
+}
+
+#undef NAMED_ERROR
+
+NamedParser named_parser(const char *data, size_t size) {
+  NamedParser np = {.ps = {data, data, data + size}};
+  sh_new_arena(np.scope);
+  return np;
+}
+
+void named_parser_free(NamedParser *np) {
+  shfree(np->scope);
+  arrfree(np->bound);
+  arrfree(np->saved);
+  arrfree(np->name);
+}
+
+// Parse every named term in a file into an stb_ds array.
+Expr **parse_named_file(const char *path) {
+  Source src = source_open(path);
+  NamedParser np = named_parser(src.data, src.size);
+  Expr **terms = NULL;
+  for (Expr *e; (e = parse_named(&np));)
+    arrput(terms, e);
+  named_parser_free(&np);
+  source_close(&src);
+  return terms;
+}
+
+// Readback with names: the binder at level n (counting from 1 at the root) is
+// called a, b, ..., z, a1, b1, ..., so names never capture each other.
+static void writer_name(Writer *w, Variable level) {
+  Variable n = level - 1;
+  writer_putc(w, 'a' + n % 26);
+  if (n >= 26)
+    writer_u32(w, n / 26);
+}
+
+void write_named(Writer *w, const Expr *expr) {
+  typedef struct {
+    const Expr *expr;
+    Variable depth;
+    char c;
+  } Item;
+
+  Item *todo = NULL;
+  arrput(todo, ((Item){expr, 0, 0}));
+  while (arrlen(todo) > 0) {
+    Item it = arrpop(todo);
+    if (!it.expr) {
+      writer_putc(w, it.c);
+      continue;
+    }
+
+    switch (it.expr->type) {
+    case EXPR_VAR:
+      if (it.expr->var > it.depth)
+        ERROR("Cannot name free variable %u", it.expr->var);
+      writer_name(w, it.depth - it.expr->var + 1);
+      break;
+    case EXPR_ABS:
+      writer_put(w, "λ", sizeof("λ") - 1);
+      writer_name(w, it.depth + 1);
+      writer_put(w, ". ", 2);
+      arrput(todo, ((Item){it.expr->abs.body, it.depth + 1, 0}));
+      break;
+    case EXPR_APP: {
+      const Expr *func = it.expr->app.func, *arg = it.expr->app.arg;
+      if (arg->type != EXPR_VAR)
+        arrput(todo, ((Item){NULL, 0, ')'}));
+      arrput(todo, ((Item){arg, it.depth, 0}));
+      if (arg->type != EXPR_VAR)
+        arrput(todo, ((Item){NULL, 0, '('}));
+      arrput(todo, ((Item){NULL, 0, ' '}));
+      if (func->type == EXPR_ABS) {
+        arrput(todo, ((Item){NULL, 0, ')'}));
+        writer_putc(w, '(');
+      }
+      arrput(todo, ((Item){func, it.depth, 0}));
+      break;
+    }
+    }
+  }
+  arrfree(todo);
+}
+
+#define print_named(expr)                                                      \
+  {                                                                            \
+    Writer w_ = writer_fd(STDOUT_FILENO);                                      \
+    write_named(&w_, (expr));                                                  \
+    writer_putc(&w_, '\n');                                                    \
+    writer_free(&w_);                                                          \
+  }                                                                            \
+  while (0)
+
+// Binary Lambda Calculus: λ is 00, application 01 and variable n is n ones
+// followed by a zero. Bits are packed most significant first (BLC8); the
+// ASCII form spells them as '0' and '1'. Each term starts on a byte boundary
+// and the last byte is padded with zeros. In the ASCII form a line break also
+// ends the byte, so unpadded terms may be written one per line.
+typedef struct {
+  uint8_t *buf; // stb_ds array
+  uint64_t acc;
+  unsigned bits;
+} BitWriter;
+
+static inline void bits_put(BitWriter *w, uint64_t v, unsigned n) {
+  w->acc = (w->acc << n) | v;
+  w->bits += n;
+  while (w->bits >= 8) {
+    w->bits -= 8;
+    arrput(w->buf, (uint8_t)(w->acc >> w->bits));
+  }
+}
+
+static void bits_align(BitWriter *w) {
+  if (w->bits)
+    bits_put(w, 0, 8 - w->bits);
+}
+
+void blc_write(BitWriter *w, const Expr *expr) {
+  const Expr **todo = NULL;
+  arrput(todo, expr);
+  while (arrlen(todo) > 0) {
+    const Expr *e = arrpop(todo);
+    switch (e->type) {
+    case EXPR_VAR: {
+      Variable n = e->var;
+      for (; n > 56; n -= 56)
+        bits_put(w, (1ull << 56) - 1, 56);
+      bits_put(w, ((1ull << n) - 1) << 1, n + 1);
+      break;
+    }
+    case EXPR_ABS:
+      bits_put(w, 0, 2);
+      arrput(todo, e->abs.body);
+      break;
+    case EXPR_APP:
+      bits_put(w, 1, 2);
+      arrput(todo, e->app.arg);
+      arrput(todo, e->app.func);
+      break;
+    }
+  }
+  arrfree(todo);
+  bits_align(w);
+}
+
+// `acc` holds the next `avail` bits left-aligned.
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t acc;
+  unsigned avail;
+} BitReader;
+
+static inline void bits_refill(BitReader *r) {
+  while (r->avail <= 56 && r->p < r->end) {
+    r->acc |= (uint64_t)*r->p++ << (56 - r->avail);
+    r->avail += 8;
+  }
+}
+
+static inline void bits_skip(BitReader *r, unsigned n) {
+  r->acc = n < 64 ? r->acc << n : 0;
+  r->avail -= n;
+}
+
+// Decode one term, or return NULL at end of input.
+Expr *blc_read(BitReader *r) {
+  typedef struct {
+    bool abs;
+    Expr *func;
+  } Open;
+
+  r->acc = 0;
+  r->avail = 0;
+  bits_refill(r);
+  if (!r->avail)
+    return NULL;
+
+  Open *open = NULL;
+  Expr *val;
+  for (;;) {
+    bits_refill(r);
+    if (r->avail < 2)
+      ERROR("Truncated BLC input");
+
+    if (!(r->acc >> 63)) {
+      arrput(open, ((Open){!(r->acc >> 62), NULL}));
+      bits_skip(r, 2);
+      continue;
+    }
+
+    Variable n = 0;
+    for (;;) {
+      unsigned ones = ~r->acc ? __builtin_clzll(~r->acc) : 64;
+      if (ones < r->avail) {
+        n += ones;
+        bits_skip(r, ones + 1);
+        break;
+      }
+      n += r->avail;
+      bits_skip(r, r->avail);
+      bits_refill(r);
+      if (!r->avail)
+        ERROR("Truncated BLC input");
+    }
+    val = new_var(n);
+
+    while (arrlen(open) > 0) {
+      Open *top = &arrlast(open);
+      if (top->abs) {
+        val = new_abs(val);
+      } else if (!top->func) {
+        top->func = val;
+        break;
+      } else {
+        val = new_app(top->func, val);
+      }
+      arrsetlen(open, arrlen(open) - 1);
+    }
+    if (arrlen(open) == 0)
+      break;
+  }
+
+  arrfree(open);
+  // Drop the padding of the last byte read.
+  r->p -= r->avail / 8;
+  return val;
+}
+
+// Decode every term of a BLC8 buffer, or of ASCII BLC when `text` is set
+// (other characters are ignored).
+Expr **blc_read_all(const char *data, size_t size, bool text) {
+  uint8_t *packed = NULL;
+  if (text) {
+    BitWriter w = {0};
+    for (size_t i = 0; i < size; i++)
+      if (data[i] == '0' || data[i] == '1')
+        bits_put(&w, data[i] - '0', 1);
+      else if (data[i] == '\n')
+        bits_align(&w);
+    bits_align(&w);
+    packed = w.buf;
+    data = (const char *)packed;
+    size = arrlenu(packed);
+  }
+
+  BitReader r = {(const uint8_t *)data, (const uint8_t *)data + size, 0, 0};
+  Expr **terms = NULL;
+  for (Expr *e; (e = blc_read(&r));)
+    arrput(terms, e);
+  arrfree(packed);
+  return terms;
+}
+
+Expr **parse_blc_file(const char *path, bool text) {
+  Source src = source_open(path);
+  Expr **terms = blc_read_all(src.data, src.size, text);
+  source_close(&src);
+  return terms;
+}
+
+// The ASCII form has one term per line.
+void write_blc_file(const char *path, Expr **terms, size_t count, bool text) {
+  BitWriter w = {0};
+  size_t *ends = NULL; // where each term's bytes end
+  for (size_t i = 0; i < count; i++) {
+    blc_write(&w, terms[i]);
+    arrput(ends, arrlenu(w.buf));
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    ERROR("Cannot open %s", path);
+  bool ok = true;
+  if (text) {
+    for (size_t t = 0, i = 0; t < count && ok; t++) {
+      for (; i < ends[t] && ok; i++)
+        for (int b = 7; b >= 0 && ok; b--)
+          ok = fputc('0' + ((w.buf[i] >> b) & 1), f) != EOF;
+      ok = ok && fputc('\n', f) != EOF;
+    }
+  } else {
+    ok = fwrite(w.buf, 1, arrlenu(w.buf), f) == arrlenu(w.buf);
+  }
+  if (!ok || fclose(f))
+    ERROR("Cannot write %s", path);
+  arrfree(ends);
+  arrfree(w.buf);
+}
+
+// Compact term store: every node lives in one contiguous array and refers to
+// its children by 32-bit index, with the ExprType packed into the top two bits
+// of the first word. Children are stored before their parents.
+typedef uint32_t NodeId;
+typedef struct {
+  uint32_t a;
+  uint32_t b;
+} Node;
+typedef Node *NodeStore;
+
+#define NODE_TAG_SHIFT 30
+#define NODE_MAX ((1u << NODE_TAG_SHIFT) - 1)
+#define NODE_TYPE(n) ((ExprType)((n).a >> NODE_TAG_SHIFT))
+#define NODE_A(n) ((n).a & NODE_MAX)
+#define NODE_B(n) ((n).b)
+
+NodeId store_push(NodeStore *st, ExprType type, uint32_t a, uint32_t b) {
+  if (a > NODE_MAX || arrlenu(*st) > NODE_MAX)
+    ERROR("Node store overflow");
+  Node n = {((uint32_t)type << NODE_TAG_SHIFT) | a, b};
+  arrput(*st, n);
+  return (NodeId)(arrlen(*st) - 1);
+}
+
+typedef struct {
+  const Expr *key;
+  NodeId value;
+} NodeMemo;
+
+// State for laying Expr graphs out in a store: the interior nodes already
+// stored, and the node for each small variable index (plus one, 0 if absent),
+// so that all occurrences of a variable share one node.
+#define STORE_SHARED_VARS 4096
+
+typedef struct {
+  NodeMemo *seen;
+  NodeId *vars;
+} StoreBuilder;
+
+static NodeId store_var(NodeStore *st, StoreBuilder *b, Variable var) {
+  if (var >= STORE_SHARED_VARS)
+    return store_push(st, EXPR_VAR, var, 0);
+  while (arrlenu(b->vars) <= var)
+    arrput(b->vars, 0);
+  if (!b->vars[var])
+    b->vars[var] = store_push(st, EXPR_VAR, var, 0) + 1;
+  return b->vars[var] - 1;
+}
+
+// Append `expr` in post-order, without recursion, and return its root.
+NodeId store_add(NodeStore *st, StoreBuilder *b, const Expr *expr) {
+  typedef struct {
+    const Expr *expr;
+    bool expanded;
+  } Item;
+
+  if (!expr)
+    ERROR("NULL expression");
+
+  Item *todo = NULL;
+  NodeId *vals = NULL;
+  arrput(todo, ((Item){expr, false}));
+
+  while (arrlen(todo) > 0) {
+    Item it = arrpop(todo);
+    const Expr *e = it.expr;
+    if (e->type == EXPR_VAR) {
+      arrput(vals, store_var(st, b, e->var));
+      continue;
+    }
+
+    if (!it.expanded) {
+      ptrdiff_t i = hmgeti(b->seen, e);
+      if (i >= 0) {
+        arrput(vals, b->seen[i].value);
+        continue;
+      }
+      arrput(todo, ((Item){e, true}));
+      if (e->type == EXPR_ABS) {
+        arrput(todo, ((Item){e->abs.body, false}));
+      } else {
+        arrput(todo, ((Item){e->app.arg, false}));
+        arrput(todo, ((Item){e->app.func, false}));
+      }
+      continue;
+    }
+
+    NodeId id;
+    if (e->type == EXPR_ABS) {
+      id = store_push(st, EXPR_ABS, arrpop(vals), 0);
+    } else {
+      NodeId arg = arrpop(vals);
+      id = store_push(st, EXPR_APP, arrpop(vals), arg);
+    }
+    hmput(b->seen, e, id);
+    arrput(vals, id);
+  }
+
+  NodeId root = vals[0];
+  arrfree(todo);
+  arrfree(vals);
+  return root;
+}
+
+void store_builder_free(StoreBuilder *b) {
+  hmfree(b->seen);
+  arrfree(b->vars);
+}
+
+// Append `expr` to the store and return the index of its root. Subterms shared
+// in the Expr graph are stored once.
+NodeId store_from_expr(NodeStore *st, const Expr *expr) {
+  StoreBuilder b = {0};
+  NodeId root = store_add(st, &b, expr);
+  store_builder_free(&b);
+  return root;
+}
+
+// Rebuild the Expr graph rooted at `root`. Only the nodes reachable from it
+// are visited, each once, so sharing is preserved and rebuilding every root
+// of an image costs no more than the nodes they use.
+Expr *store_to_expr(const Node *nodes, NodeId root) {
+  typedef struct {
+    NodeId id;
+    bool done; // children built
+  } BuildTask;
+
+  struct {
+    NodeId key;
+    Expr *value;
+  } *built = NULL;
+  BuildTask *todo = NULL;
+  arrput(todo, ((BuildTask){root, false}));
+  while (arrlen(todo) > 0) {
+    BuildTask t = arrpop(todo);
+    if (hmgeti(built, t.id) >= 0)
+      continue;
+    Node n = nodes[t.id];
+    if (!t.done && NODE_TYPE(n) != EXPR_VAR) {
+      arrput(todo, ((BuildTask){t.id, true}));
+      if (NODE_TYPE(n) == EXPR_APP)
+        arrput(todo, ((BuildTask){NODE_B(n), false}));
+      arrput(todo, ((BuildTask){NODE_A(n), false}));
+      continue;
+    }
+    Expr *e;
+    switch (NODE_TYPE(n)) {
+    case EXPR_VAR:
+      e = new_var(NODE_A(n));
+      break;
+    case EXPR_ABS:
+      e = new_abs(hmget(built, NODE_A(n)));
+      break;
+    case EXPR_APP: {
+      Expr *func = hmget(built, NODE_A(n));
+      e = new_app(func, hmget(built, NODE_B(n)));
+      break;
+    }
+    default:
+      ERROR("Corrupt node %u in store", t.id);
+    }
+    hmput(built, t.id, e);
+  }
+
+  Expr *res = hmget(built, root);
+  arrfree(todo);
+  hmfree(built);
+  return res;
+}
+
+// Binary term image: a header, the root index of each term, then the node
+// store they share. Nodes refer to each other by index, so the file can be
+// mapped at any address and used in place. Integers are little-endian.
+#define IMAGE_MAGIC "LCIMAGE"
+#define IMAGE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t root_count;
+  uint64_t node_count;
+  uint64_t checksum; // image_checksum() of everything after the header
+} ImageHeader;
+
+typedef struct {
+  const ImageHeader *header;
+  const NodeId *roots;
+  const Node *nodes;
+  size_t size;
+} Image;
+
+// Word-at-a-time multiplicative hash; `size` is a multiple of 8.
+static uint64_t image_checksum(const void *data, size_t size) {
+  const unsigned char *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+static size_t image_roots_size(uint32_t root_count) {
+  return ((size_t)root_count * sizeof(NodeId) + 7) & ~(size_t)7;
+}
+
+// Write `terms` to `path` as one image. Subterms shared between or within the
+// terms are stored once.
+void image_write(const char *path, Expr **terms, uint32_t count) {
+  NodeStore st = NULL;
+  StoreBuilder b = {0};
+  size_t roots_size = image_roots_size(count);
+  NodeId *roots = calloc(1, roots_size ? roots_size : 1);
+  if (!roots)
+    ERROR("Memory allocation failed");
+  for (uint32_t i = 0; i < count; i++)
+    roots[i] = store_add(&st, &b, terms[i]);
+  store_builder_free(&b);
+
+  size_t nodes_size = arrlenu(st) * sizeof(Node);
+  ImageHeader h = {IMAGE_MAGIC, IMAGE_VERSION, count, arrlenu(st), 0};
+  h.checksum = image_checksum(roots, roots_size) ^
+               image_checksum(st, nodes_size) * 0x9e3779b97f4a7c15ull;
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    ERROR("Cannot open %s", path);
+  if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+      fwrite(roots, 1, roots_size, f) != roots_size ||
+      fwrite(st, 1, nodes_size, f) != nodes_size || fclose(f))
+    ERROR("Cannot write %s", path);
+
+  free(roots);
+  arrfree(st);
+}
+
+// Map an image read-only. The header and sizes are always validated; the
+// checksum pass reads the whole file and is only done when `verify` is set.
+Image image_open(const char *path, bool verify) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    ERROR("Cannot open %s", path);
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ImageHeader))
+    ERROR("%s is not a term image", path);
+
+  Image img = {.size = st.st_size};
+  void *data = mmap(NULL, img.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    ERROR("Cannot map %s", path);
+
+  img.header = data;
+  if (memcmp(img.header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) ||
+      img.header->version != IMAGE_VERSION)
+    ERROR("%s is not a version %d term image", path, IMAGE_VERSION);
+
+  // The counts come from the file: bound them by its size before multiplying.
+  size_t roots_size = image_roots_size(img.header->root_count);
+  if (roots_size > img.size - sizeof(ImageHeader) ||
+      img.header->node_count > (uint64_t)NODE_MAX + 1 ||
+      img.header->node_count >
+          (img.size - sizeof(ImageHeader) - roots_size) / sizeof(Node))
+    ERROR("%s is truncated", path);
+  size_t nodes_size = img.header->node_count * sizeof(Node);
+  if (img.size != sizeof(ImageHeader) + roots_size + nodes_size)
+    ERROR("%s is truncated", path);
+  img.roots = (const NodeId *)(img.header + 1);
+  img.nodes = (const Node *)((const char *)img.roots + roots_size);
+
+  for (uint32_t i = 0; i < img.header->root_count; i++)
+    if (img.roots[i] >= img.header->node_count)
+      ERROR("%s has an out of range root", path);
+  // Children precede their parents, which the readers rely on.
+  for (uint64_t i = 0; i < img.header->node_count; i++) {
+    Node n = img.nodes[i];
+    if ((NODE_TYPE(n) != EXPR_VAR && NODE_A(n) >= i) ||
+        (NODE_TYPE(n) == EXPR_APP && NODE_B(n) >= i))
+      ERROR("%s has an out of order node %" PRIu64, path, i);
+  }
+
+  if (verify &&
+      (image_checksum(img.roots, roots_size) ^
+       image_checksum(img.nodes, nodes_size) * 0x9e3779b97f4a7c15ull) !=
+          img.header->checksum)
+    ERROR("%s failed its checksum", path);
+
+  return img;
+}
+
+void image_close(Image *img) { munmap((void *)img->header, img->size); }
+
+#if TRACE
+// Reduction tracing, switched on and off at run time with trace_enable. Each
+// thread records into its own ring buffer, so recording needs no locks; when a
+// ring is full its oldest events are overwritten. Build with -DTRACE=0 to
+// compile every trace point out.
+#define TRACE_RING_SIZE (1 << 20) // events per thread, a power of two
+
+typedef struct {
+  TraceEvent *events;
+  uint64_t head; // events recorded so far
+} TraceRing;
+
+static _Thread_local TraceRing trace_ring;
+bool trace_on = false;
+static uint64_t trace_start;
+
+static inline uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void trace_put(TraceRing *r, uint32_t node, uint32_t info) {
+  r->events[r->head & (TRACE_RING_SIZE - 1)] = (TraceEvent){node, info};
+  // Publish the event only once it is complete.
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_clock(TraceRing *r) {
+  uint64_t t = trace_now() - trace_start;
+  trace_put(r, (uint32_t)t, TRACE_CLOCK | (uint32_t)(t >> 32) << 4);
+}
+
+static void trace_record(TraceKind kind, const void *node, uint32_t info) {
+  TraceRing *r = &trace_ring;
+  if (!r->events && !(r->events = malloc(TRACE_RING_SIZE * sizeof(TraceEvent))))
+    ERROR("Memory allocation failed");
+  if (r->head % TRACE_CLOCK_INTERVAL == 0)
+    trace_clock(r);
+  trace_put(r, (uintptr_t)node / ARENA_ALIGN, kind | info << 4);
+}
+
+void trace_enable(bool on) {
+  if (on && !trace_start)
+    trace_start = trace_now();
+  // Close the last clock interval, so that its events are not spread over
+  // whatever follows.
+  if (!on && trace_on && trace_ring.events)
+    trace_clock(&trace_ring);
+  trace_on = on;
+}
+
+static inline void trace(TraceKind kind, const void *node, uint32_t info) {
+  if (__builtin_expect(trace_on, 0))
+    trace_record(kind, node, info);
+}
+
+// Append the calling thread's events to a trace file as one section.
+void trace_write(int fd, uint32_t thread) {
+  TraceRing *r = &trace_ring;
+  if (trace_on && r->events)
+    trace_clock(r); // so the last events can be timed
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  TraceHeader h = {TRACE_MAGIC, TRACE_VERSION, thread, head - first, first};
+
+  Writer w = writer_fd(fd);
+  writer_put(&w, (const char *)&h, sizeof(h));
+  for (uint64_t i = first; i < head;) {
+    uint64_t at = i & (TRACE_RING_SIZE - 1);
+    uint64_t n = head - i < TRACE_RING_SIZE - at ? head - i : TRACE_RING_SIZE - at;
+    writer_put(&w, (const char *)(r->events + at), n * sizeof(TraceEvent));
+    i += n;
+  }
+  writer_free(&w);
+}
+
+void trace_free(void) {
+  free(trace_ring.events);
+  trace_ring = (TraceRing){0};
+}
+
+// The trace file opened by trace_open. Worker threads append their section
+// as they finish, numbered from 1; the opening thread's is written last, as
+// thread 0, by trace_close.
+static int trace_fd = -1;
+static uint32_t trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void trace_open(const char *path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0)
+    ERROR("Cannot open %s", path);
+}
+
+// Call at the end of every worker thread.
+void trace_thread_exit(void) {
+  if (trace_fd >= 0 && trace_ring.events) {
+    pthread_mutex_lock(&trace_lock);
+    trace_write(trace_fd, ++trace_threads);
+    pthread_mutex_unlock(&trace_lock);
+  }
+  trace_free();
+}
+
+void trace_close(void) {
+  if (trace_fd < 0)
+    return;
+  trace_write(trace_fd, 0);
+  close(trace_fd);
+  trace_fd = -1;
+  trace_free();
+}
+#else
+#define trace(kind, node, info) ((void)0)
+
+void trace_enable(bool on) {
+  if (on)
+    ERROR("Built without tracing (TRACE=0)");
+}
+
+void trace_write(int fd, uint32_t thread) {}
+void trace_free(void) {}
+
+void trace_open(const char *path) {
+  ERROR("Built without tracing (TRACE=0)");
+}
+
+void trace_thread_exit(void) {}
+void trace_close(void) {}
+#endif
+
+// Add `d` to every variable of `expr` that is free above `cutoff` binders.
+// Unchanged subterms are returned as-is, so closed terms are never copied.
+Expr *shift(Expr *expr, int d, Variable cutoff) {
+  typedef struct {
+    Expr *expr;
+    Variable cutoff;
+    bool done; // children shifted, on top of `vals`
+  } ShiftTask;
+
+  if (!d)
+    return expr;
+  if (expr->type == EXPR_VAR)
+    return expr->var > cutoff ? new_var(expr->var + d) : expr;
+
+  ShiftTask *todo = NULL;
+  Expr **vals = NULL;
+  arrput(todo, ((ShiftTask){expr, cutoff, false}));
+  while (arrlen(todo) > 0) {
+    ShiftTask t = arrpop(todo);
+    Expr *e = t.expr;
+    if (e->type == EXPR_VAR) {
+      arrput(vals, e->var > t.cutoff ? new_var(e->var + d) : e);
+    } else if (!t.done) {
+      arrput(todo, ((ShiftTask){e, t.cutoff, true}));
+      if (e->type == EXPR_ABS) {
+        arrput(todo, ((ShiftTask){e->abs.body, t.cutoff + 1, false}));
+      } else {
+        arrput(todo, ((ShiftTask){e->app.arg, t.cutoff, false}));
+        arrput(todo, ((ShiftTask){e->app.func, t.cutoff, false}));
+      }
+    } else if (e->type == EXPR_ABS) {
+      Expr *body = arrlast(vals);
+      arrlast(vals) = body == e->abs.body ? e : new_abs(body);
+    } else {
+      Expr *arg = arrpop(vals), *func = arrlast(vals);
+      arrlast(vals) = func == e->app.func && arg == e->app.arg
+                          ? e
+                          : new_app(func, arg);
+    }
+  }
+  Expr *res = vals[0];
+  arrfree(todo);
+  arrfree(vals);
+  return res;
+}
+
+Env *env_push(Closure clo, Env *next) {
+  Env *env = arena_alloc(&eval_arena, sizeof(Env));
+  env->clo = clo;
+  env->next = next;
+  return env;
+}
+
+Env *env_cell(Env *env, Variable var) {
+  stats.lookups++;
+  for (Variable i = 1; i < var && env; i++)
+    env = env->next;
+  if (!env)
+    ERROR("Variable %u not found in environment", var);
+  return env;
+}
+
+Closure env_lookup(Env *env, Variable var) { return env_cell(env, var)->clo; }
+
+// Substitute the environment of a closure back into its term. `depth` counts
+// the binders passed inside `term`, whose variables stay bound. A closure
+// found in the environment is read back where it is used, so its free
+// variables are lifted by the binders above it; each task carries that lift
+// instead of shifting the result afterwards. Nothing is copied where the
+// environment is empty.
+Expr *readback(Expr *term, Env *env, Variable depth) {
+  typedef struct {
+    Expr *term;
+    Env *env;
+    Variable depth, lift;
+    bool done; // children read back, on top of `vals`
+  } ReadTask;
+
+  if (!env)
+    return term;
+
+  ReadTask *todo = NULL;
+  Expr **vals = NULL;
+  arrput(todo, ((ReadTask){term, env, depth, 0, false}));
+  while (arrlen(todo) > 0) {
+    ReadTask t = arrpop(todo);
+    Expr *e = t.term;
+    if (t.done) {
+      if (e->type == EXPR_ABS) {
+        arrlast(vals) = new_abs(arrlast(vals));
+      } else {
+        Expr *arg = arrpop(vals);
+        arrlast(vals) = new_app(arrlast(vals), arg);
+      }
+    } else if (!t.env) {
+      arrput(vals, shift(e, t.lift, t.depth));
+    } else if (e->type == EXPR_VAR) {
+      if (e->var <= t.depth) {
+        arrput(vals, e);
+        continue;
+      }
+      Variable i = e->var - t.depth;
+      Env *cell = t.env;
+      for (; i > 1 && cell; i--)
+        cell = cell->next;
+      if (!cell)
+        arrput(vals, new_var(t.depth + i + t.lift));
+      else
+        arrput(todo, ((ReadTask){cell->clo.term, cell->clo.env, 0,
+                                 t.depth + t.lift, false}));
+    } else if (e->type == EXPR_ABS) {
+      arrput(todo, ((ReadTask){e, t.env, t.depth, t.lift, true}));
+      arrput(todo,
+             ((ReadTask){e->abs.body, t.env, t.depth + 1, t.lift, false}));
+    } else {
+      arrput(todo, ((ReadTask){e, t.env, t.depth, t.lift, true}));
+      arrput(todo, ((ReadTask){e->app.arg, t.env, t.depth, t.lift, false}));
+      arrput(todo, ((ReadTask){e->app.func, t.env, t.depth, t.lift, false}));
+    }
+  }
+  Expr *res = vals[0];
+  arrfree(todo);
+  arrfree(vals);
+  return res;
+}
+
+// Krivine machine: call-by-name reduction to weak head normal form. Arguments
+// are pushed as closures over the current environment instead of being
+// evaluated, and a lambda pops one of them into a new environment cell.
+Expr *krivine(Expr *expr) {
+  Closure *stack = NULL;
+  Expr *term = expr;
+  Env *env = NULL;
+
+  for (;;) {
+    switch (term->type) {
+    case EXPR_VAR: {
+      trace(TRACE_LOOKUP, term, term->var);
+      Closure c = env_lookup(env, term->var);
+      term = c.term;
+      env = c.env;
+      break;
+    }
+    case EXPR_APP:
+      arrput(stack, ((Closure){term->app.arg, env}));
+      stats_depth(arrlen(stack));
+      trace(TRACE_PUSH, term, arrlen(stack));
+      term = term->app.func;
+      break;
+    case EXPR_ABS:
+      if (arrlen(stack) == 0) {
+        arrfree(stack);
+        return readback(term, env, 0);
+      }
+      trace(TRACE_BETA, term, arrlen(stack));
+      env = env_push(arrpop(stack), env);
+      term = term->abs.body;
+      stats.beta++;
+      break;
+    }
+  }
+}
+
+// Krivine machine running directly on a node store, for terms that are only
+// available as nodes (such as a mapped image). Only the result is rebuilt as
+// an Expr.
+typedef struct StoreEnv StoreEnv;
+
+typedef struct {
+  NodeId term;
+  StoreEnv *env;
+} StoreClosure;
+
+struct StoreEnv {
+  StoreClosure clo;
+  StoreEnv *next;
+};
+
+// readback for closures over store nodes.
+static Expr *store_readback(const Node *nodes, NodeId term, StoreEnv *env) {
+  typedef struct {
+    NodeId term;
+    StoreEnv *env;
+    Variable depth, lift;
+    bool done; // children read back, on top of `vals`
+  } ReadTask;
+
+  ReadTask *todo = NULL;
+  Expr **vals = NULL;
+  arrput(todo, ((ReadTask){term, env, 0, 0, false}));
+  while (arrlen(todo) > 0) {
+    ReadTask t = arrpop(todo);
+    Node n = nodes[t.term];
+    if (t.done) {
+      if (NODE_TYPE(n) == EXPR_ABS) {
+        arrlast(vals) = new_abs(arrlast(vals));
+      } else {
+        Expr *arg = arrpop(vals);
+        arrlast(vals) = new_app(arrlast(vals), arg);
+      }
+      continue;
+    }
+    if (!t.env) {
+      arrput(vals, shift(store_to_expr(nodes, t.term), t.lift, t.depth));
+      continue;
+    }
+    switch (NODE_TYPE(n)) {
+    case EXPR_VAR: {
+      if (NODE_A(n) <= t.depth) {
+        arrput(vals, new_var(NODE_A(n)));
+        break;
+      }
+      Variable i = NODE_A(n) - t.depth;
+      StoreEnv *cell = t.env;
+      for (; i > 1 && cell; i--)
+        cell = cell->next;
+      if (!cell)
+        arrput(vals, new_var(t.depth + i + t.lift));
+      else
+        arrput(todo, ((ReadTask){cell->clo.term, cell->clo.env, 0,
+                                 t.depth + t.lift, false}));
+      break;
+    }
+    case EXPR_ABS:
+      arrput(todo, ((ReadTask){t.term, t.env, t.depth, t.lift, true}));
+      arrput(todo,
+             ((ReadTask){NODE_A(n), t.env, t.depth + 1, t.lift, false}));
+      break;
+    case EXPR_APP:
+      arrput(todo, ((ReadTask){t.term, t.env, t.depth, t.lift, true}));
+      arrput(todo, ((ReadTask){NODE_B(n), t.env, t.depth, t.lift, false}));
+      arrput(todo, ((ReadTask){NODE_A(n), t.env, t.depth, t.lift, false}));
+      break;
+    default:
+      ERROR("Corrupt node %u in store", t.term);
+    }
+  }
+  Expr *res = vals[0];
+  arrfree(todo);
+  arrfree(vals);
+  return res;
+}
+
+Expr *store_krivine(const Node *nodes, NodeId root) {
+  StoreClosure *stack = NULL;
+  NodeId term = root;
+  StoreEnv *env = NULL;
+
+  for (;;) {
+    Node n = nodes[term];
+    switch (NODE_TYPE(n)) {
+    case EXPR_VAR: {
+      stats.lookups++;
+      StoreEnv *e = env;
+      for (Variable i = NODE_A(n); i > 1 && e; i--)
+        e = e->next;
+      if (!e)
+        ERROR("Variable %u not found in environment", NODE_A(n));
+      term = e->clo.term;
+      env = e->clo.env;
+      break;
+    }
+    case EXPR_APP:
+      arrput(stack, ((StoreClosure){NODE_B(n), env}));
+      stats_depth(arrlen(stack));
+      term = NODE_A(n);
+      break;
+    case EXPR_ABS: {
+      if (arrlen(stack) == 0) {
+        arrfree(stack);
+        return store_readback(nodes, term, env);
+      }
+      StoreEnv *e = arena_alloc(&eval_arena, sizeof(StoreEnv));
+      e->clo = arrpop(stack);
+      e->next = env;
+      env = e;
+      term = NODE_A(n);
+      stats.beta++;
+      break;
+    }
+    default:
+      ERROR("Corrupt node %u in store", term);
+    }
+  }
+}
+
+// CEK machine: call-by-value reduction to weak head normal form, evaluating
+// an application's argument before its function. Pending work is kept as
+// frames on `s` rather than on the C stack, so the depth of the term is only
+// bounded by the heap. Frames below the initial height of `s` are left alone.
+Expr *eval(Expr *expr, Stack *s) {
+  ptrdiff_t base = arrlen(*s);
+  Closure c = {expr, NULL};
+
+  for (;;) {
+    // Control: reduce c to a value.
+    switch (c.term->type) {
+    case EXPR_VAR:
+      trace(TRACE_LOOKUP, c.term, c.term->var);
+      c = env_lookup(c.env, c.term->var);
+      break;
+    case EXPR_APP:
+      arrput(*s, ((Frame){FRAME_FUNC, {c.term->app.func, c.env}}));
+      stats_depth(arrlen(*s));
+      trace(TRACE_PUSH, c.term, arrlen(*s));
+      c.term = c.term->app.arg;
+      continue;
+    case EXPR_ABS:
+      break;
+    }
+
+    // Continuation: c is a value, hand it to the innermost frame.
+    for (;;) {
+      if (arrlen(*s) == base)
+        return readback(c.term, c.env, 0);
+
+      Frame *f = &arrlast(*s);
+      if (f->type == FRAME_FUNC) {
+        Closure func = f->clo;
+        f->type = FRAME_CALL;
+        f->clo = c;
+        c = func;
+        break;
+      }
+
+      trace(TRACE_BETA, c.term, arrlen(*s));
+      Closure arg = arrpop(*s).clo;
+      c = (Closure){c.term->abs.body, env_push(arg, c.env)};
+      stats.beta++;
+      break;
+    }
+  }
+}
+
+// How many binders `expr` needs around it to be closed.
+static Variable expr_open_depth(const Expr *expr) {
+  typedef struct {
+    const Expr *expr;
+    Variable depth;
+  } OpenTask;
+
+  OpenTask *todo = NULL;
+  Variable open = 0;
+  arrput(todo, ((OpenTask){expr, 0}));
+  while (arrlen(todo) > 0) {
+    OpenTask t = arrpop(todo);
+    if (t.expr->type == EXPR_VAR) {
+      if (t.expr->var > t.depth && t.expr->var - t.depth > open)
+        open = t.expr->var - t.depth;
+    } else if (t.expr->type == EXPR_ABS) {
+      arrput(todo, ((OpenTask){t.expr->abs.body, t.depth + 1}));
+    } else {
+      arrput(todo, ((OpenTask){t.expr->app.arg, t.depth}));
+      arrput(todo, ((OpenTask){t.expr->app.func, t.depth}));
+    }
+  }
+  arrfree(todo);
+  return open;
+}
+
+// Contract the redex (λ body) arg: replace variable 1 of `body` by `arg`,
+// shifting `arg` under binders and lowering the remaining free variables.
+// Unchanged subterms of `body` are kept. Whether `arg` is closed, and so
+// needs no shifting, is only worked out the first time it is substituted
+// under a binder.
+Expr *subst(Expr *body, Expr *arg) {
+  typedef struct {
+    Expr *expr;
+    Variable depth;
+    bool done; // children substituted, on top of `vals`
+  } SubstTask;
+
+  SubstTask *todo = NULL;
+  Expr **vals = NULL;
+  int closed = -1; // unknown until needed
+  arrput(todo, ((SubstTask){body, 0, false}));
+  while (arrlen(todo) > 0) {
+    SubstTask t = arrpop(todo);
+    Expr *e = t.expr;
+    if (e->type == EXPR_VAR) {
+      if (e->var <= t.depth) {
+        arrput(vals, e);
+      } else if (e->var > t.depth + 1) {
+        arrput(vals, new_var(e->var - 1));
+      } else {
+        if (t.depth && closed < 0)
+          closed = !expr_open_depth(arg);
+        arrput(vals, t.depth && !closed ? shift(arg, t.depth, 0) : arg);
+      }
+    } else if (!t.done) {
+      arrput(todo, ((SubstTask){e, t.depth, true}));
+      if (e->type == EXPR_ABS) {
+        arrput(todo, ((SubstTask){e->abs.body, t.depth + 1, false}));
+      } else {
+        arrput(todo, ((SubstTask){e->app.arg, t.depth, false}));
+        arrput(todo, ((SubstTask){e->app.func, t.depth, false}));
+      }
+    } else if (e->type == EXPR_ABS) {
+      Expr *b = arrlast(vals);
+      arrlast(vals) = b == e->abs.body ? e : new_abs(b);
+    } else {
+      Expr *a = arrpop(vals), *func = arrlast(vals);
+      arrlast(vals) =
+          func == e->app.func && a == e->app.arg ? e : new_app(func, a);
+    }
+  }
+  Expr *res = vals[0];
+  arrfree(todo);
+  arrfree(vals);
+  return res;
+}
+
+// Normal-order reduction to beta-normal form, reducing under lambdas. The head
+// of each application spine is contracted first, then the body and arguments
+// of the resulting head normal form are normalized left to right. Pending work
+// lives in explicit arrays rather than on the C stack. Diverges if the term
+// has no normal form.
+Expr *normalize(Expr *expr) {
+  typedef enum { NORM_TERM, NORM_ABS, NORM_APP } NormOp;
+  typedef struct {
+    NormOp op;
+    Expr *expr;
+  } NormTask;
+
+  NormTask *todo = NULL;
+  Expr **vals = NULL;
+  Expr **args = NULL;
+  // With --refcount every term held in todo, vals or args owns a reference,
+  // so contracted redexes are released as soon as they are replaced.
+  arrput(todo, ((NormTask){NORM_TERM, expr_retain(expr)}));
+  gc_root(&todo, sizeof(NormTask), offsetof(NormTask, expr));
+  gc_root(&vals, sizeof(Expr *), 0);
+  gc_root(&args, sizeof(Expr *), 0);
+  // Between steps everything live is on the work stacks or in `head`.
+  Expr *head = NULL, *next;
+  gc_root(&head, 0, 0);
+
+  while (arrlen(todo) > 0) {
+    NormTask t = arrpop(todo);
+    switch (t.op) {
+    case NORM_ABS: {
+      Expr *body = arrlast(vals);
+      arrlast(vals) = expr_retain(new_abs(body));
+      expr_release(body);
+      break;
+    }
+    case NORM_APP: {
+      Expr *arg = arrpop(vals), *func = arrlast(vals);
+      arrlast(vals) = expr_retain(new_app(func, arg));
+      expr_release(func);
+      expr_release(arg);
+      break;
+    }
+    case NORM_TERM: {
+      head = t.expr;
+      for (;;) {
+        if (gc_due())
+          gc_collect();
+        if (head->type == EXPR_APP) {
+          arrput(args, expr_retain(head->app.arg));
+          stats_depth(arrlen(args));
+          next = expr_retain(head->app.func);
+          expr_release(head);
+          head = next;
+        } else if (head->type == EXPR_ABS && arrlen(args) > 0) {
+          trace(TRACE_BETA, head, arrlen(args));
+          Expr *arg = arrpop(args);
+          next = expr_retain(subst(head->abs.body, arg));
+          expr_release(head);
+          expr_release(arg);
+          head = next;
+          stats.beta++;
+        } else {
+          break;
+        }
+      }
+
+      // Spine arguments were collected innermost last; schedule them so the
+      // head is rebuilt first and each argument is applied in order.
+      for (ptrdiff_t i = 0; i < arrlen(args); i++) {
+        arrput(todo, ((NormTask){NORM_APP, NULL}));
+        arrput(todo, ((NormTask){NORM_TERM, args[i]}));
+      }
+      arrsetlen(args, 0);
+
+      if (head->type == EXPR_ABS) {
+        arrput(todo, ((NormTask){NORM_ABS, NULL}));
+        arrput(todo, ((NormTask){NORM_TERM, expr_retain(head->abs.body)}));
+        expr_release(head);
+      } else {
+        arrput(vals, head);
+      }
+      break;
+    }
+    }
+  }
+
+  // Hand the result back unowned, like every other engine does.
+  Expr *res = vals[0];
+  if (refcount)
+    res->refs--;
+  gc_unroot(4);
+  arrfree(todo);
+  arrfree(vals);
+  arrfree(args);
+  return res;
+}
+
+// Parallel normalization. Once a term is in head normal form, λx... h a1 .. an,
+// its arguments normalize independently. Arguments above `parallel_grain`
+// nodes become tasks on a work-stealing pool; the rest are normalized in place.
+// Each worker owns a deque: it pushes and pops its own tasks at the back, and
+// idle workers steal from the front of the others'. A worker waiting for a
+// task runs other tasks meanwhile, and threads with nothing to run sleep until
+// a task is pushed or finished. Workers allocate nodes from arenas of their
+// own, which are handed over to expr_arena when the pool shuts down, and count
+// into their own stats, which are merged then as well.
+unsigned parallel_threads = 1;
+size_t parallel_grain = 1 << 10;
+
+typedef struct {
+  Expr *expr;
+  Expr **slot; // where the normal form goes
+  int done;
+} ParTask;
+
+typedef struct ParPool ParPool;
+
+typedef struct {
+  ParPool *pool;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  ParTask **deque; // stb_ds array, live part starts at front
+  size_t front;
+  Arena arena;
+  Stats stats;
+  unsigned seed;
+} ParWorker;
+
+struct ParPool {
+  ParWorker *workers;
+  unsigned count;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  uint64_t events; // tasks pushed or finished, and the stop
+  unsigned sleeping;
+};
+
+static _Thread_local ParWorker *par_self;
+
+// Whether `expr` has at least `limit` nodes, looking at no more than that.
+static bool expr_bigger(const Expr *expr, size_t limit) {
+  const Expr *todo[64];
+  size_t n = 0, seen = 0;
+  todo[n++] = expr;
+  while (n > 0) {
+    const Expr *e = todo[--n];
+    if (++seen >= limit)
+      return true;
+    if (e->type == EXPR_ABS) {
+      todo[n++] = e->abs.body;
+    } else if (e->type == EXPR_APP) {
+      todo[n++] = e->app.arg;
+      // Past the budget of the little stack, assume the term is big.
+      if (n == 64)
+        return true;
+      todo[n++] = e->app.func;
+    }
+  }
+  return false;
+}
+
+// Wake the sleeping threads: there may be work for them.
+static void par_notify(ParPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->events, 1, __ATOMIC_RELEASE);
+  if (pool->sleeping)
+    pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Sleep until an event after the `seen`th. Reading the count before looking
+// for work and sleeping on it after none was found misses no event.
+static void par_sleep(ParPool *pool, uint64_t seen) {
+  pthread_mutex_lock(&pool->lock);
+  pool->sleeping++;
+  while (pool->events == seen)
+    pthread_cond_wait(&pool->wake, &pool->lock);
+  pool->sleeping--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void par_push(ParWorker *w, ParTask *t) {
+  pthread_mutex_lock(&w->lock);
+  arrput(w->deque, t);
+  pthread_mutex_unlock(&w->lock);
+  par_notify(w->pool);
+}
+
+static ParTask *par_pop(ParWorker *w) {
+  ParTask *t = NULL;
+  pthread_mutex_lock(&w->lock);
+  if ((size_t)arrlen(w->deque) > w->front)
+    t = arrpop(w->deque);
+  if ((size_t)arrlen(w->deque) == w->front) {
+    arrsetlen(w->deque, 0);
+    w->front = 0;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return t;
+}
+
+static ParTask *par_steal(ParPool *pool, ParWorker *self) {
+  unsigned start = rand_r(&self->seed) % pool->count;
+  for (unsigned i = 0; i < pool->count; i++) {
+    ParWorker *w = &pool->workers[(start + i) % pool->count];
+    if (w == self || pthread_mutex_trylock(&w->lock))
+      continue;
+    ParTask *t = NULL;
+    if ((size_t)arrlen(w->deque) > w->front)
+      t = w->deque[w->front++];
+    pthread_mutex_unlock(&w->lock);
+    if (t)
+      return t;
+  }
+  return NULL;
+}
+
+static void par_run(ParPool *pool, ParTask *t);
+
+// Run queued or stolen work until `t` is done.
+static void par_join(ParPool *pool, ParTask *t) {
+  while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+    uint64_t seen = __atomic_load_n(&pool->events, __ATOMIC_ACQUIRE);
+    ParTask *other = par_pop(par_self);
+    if (!other)
+      other = par_steal(pool, par_self);
+    if (other)
+      par_run(pool, other);
+    else if (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE))
+      par_sleep(pool, seen);
+  }
+}
+
+// Normal form of `expr`. Only the last big argument of each head normal form
+// is continued on this thread, iteratively, so long spines of big arguments
+// do not nest C calls.
+static Expr *par_normalize(ParPool *pool, Expr *expr) {
+  typedef struct {
+    Variable binders;
+    Expr *head;
+    Expr **args; // normalized arguments, innermost last
+    ParTask **tasks;
+    ptrdiff_t hole; // argument being continued, -1 if none
+  } ParFrame;
+
+  ParFrame *frames = NULL;
+  Expr *res = NULL;
+  for (;;) {
+    ParFrame f = {0, expr, NULL, NULL, -1};
+    for (;;) {
+      if (f.head->type == EXPR_APP) {
+        arrput(f.args, f.head->app.arg);
+        f.head = f.head->app.func;
+      } else if (f.head->type == EXPR_ABS && arrlen(f.args) > 0) {
+        trace(TRACE_BETA, f.head, arrlen(f.args));
+        f.head = subst(f.head->abs.body, arrpop(f.args));
+        stats.beta++;
+      } else if (f.head->type == EXPR_ABS) {
+        f.binders++;
+        f.head = f.head->abs.body;
+      } else {
+        break;
+      }
+    }
+    stats_depth(arrlen(f.args));
+
+    for (ptrdiff_t i = 0; i < arrlen(f.args); i++) {
+      // A lone argument stays on this thread either way: continue it without
+      // measuring it, which down a long spine such as a numeral's would cost
+      // up to `parallel_grain` steps per level.
+      if (arrlen(f.args) == 1) {
+        f.hole = i;
+      } else if (!expr_bigger(f.args[i], parallel_grain)) {
+        f.args[i] = normalize(f.args[i]);
+      } else if (f.hole < 0) {
+        f.hole = i;
+      } else {
+        ParTask *t = arena_alloc(&par_self->arena, sizeof(ParTask));
+        *t = (ParTask){f.args[i], &f.args[i], 0};
+        arrput(f.tasks, t);
+        par_push(par_self, t);
+      }
+    }
+    if (f.hole >= 0) {
+      expr = f.args[f.hole];
+      arrput(frames, f);
+      continue;
+    }
+
+    // Rebuild this head normal form and every pending one around it.
+    for (;;) {
+      for (ptrdiff_t i = 0; i < arrlen(f.tasks); i++)
+        par_join(pool, f.tasks[i]);
+      if (f.hole >= 0)
+        f.args[f.hole] = res;
+      res = f.head;
+      for (ptrdiff_t i = arrlen(f.args) - 1; i >= 0; i--)
+        res = new_app(res, f.args[i]);
+      for (; f.binders > 0; f.binders--)
+        res = new_abs(res);
+      arrfree(f.args);
+      arrfree(f.tasks);
+      if (arrlen(frames) == 0) {
+        arrfree(frames);
+        return res;
+      }
+      f = arrpop(frames);
+    }
+  }
+}
+
+static void par_run(ParPool *pool, ParTask *t) {
+  *t->slot = par_normalize(pool, t->expr);
+  __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+  par_notify(pool);
+}
+
+static void *par_worker(void *arg) {
+  par_self = arg;
+  ParPool *pool = par_self->pool;
+  node_arena = &par_self->arena;
+
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+    uint64_t seen = __atomic_load_n(&pool->events, __ATOMIC_ACQUIRE);
+    ParTask *t = par_pop(par_self);
+    if (!t)
+      t = par_steal(pool, par_self);
+    if (t)
+      par_run(pool, t);
+    else if (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+      par_sleep(pool, seen);
+  }
+  par_self->stats = stats;
+  trace_thread_exit();
+  return NULL;
+}
+
+// Normalize on `parallel_threads` threads, the calling one included. Falls
+// back to normalize when nodes are shared through hash-consing, reference
+// counts or the collector, none of which are thread-safe.
+Expr *normalize_parallel(Expr *expr) {
+  if (parallel_threads <= 1 || hash_cons || refcount || gc)
+    return normalize(expr);
+
+  ParPool pool = {calloc(parallel_threads, sizeof(ParWorker)),
+                  parallel_threads, 0};
+  if (!pool.workers)
+    ERROR("Memory allocation failed");
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  for (unsigned i = 0; i < pool.count; i++) {
+    pool.workers[i].pool = &pool;
+    pool.workers[i].seed = i + 1;
+    pthread_mutex_init(&pool.workers[i].lock, NULL);
+  }
+  par_self = &pool.workers[0];
+  for (unsigned i = 1; i < pool.count; i++)
+    if (pthread_create(&pool.workers[i].thread, NULL, par_worker,
+                       &pool.workers[i]))
+      ERROR("Cannot start worker thread");
+
+  Expr *res = par_normalize(&pool, expr);
+
+  __atomic_store_n(&pool.stop, 1, __ATOMIC_RELEASE);
+  par_notify(&pool);
+  for (unsigned i = 1; i < pool.count; i++)
+    pthread_join(pool.workers[i].thread, NULL);
+  for (unsigned i = 0; i < pool.count; i++) {
+    ParWorker *w = &pool.workers[i];
+    if (i > 0)
+      stats_merge(&w->stats);
+    arena_adopt(&expr_arena, &w->arena);
+    pthread_mutex_destroy(&w->lock);
+    arrfree(w->deque);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wake);
+  free(pool.workers);
+  par_self = NULL;
+  return res;
+}
+
+// Call-by-need reduction to weak head normal form. Arguments are pushed
+// unevaluated and become thunks in the environment cell they are bound to.
+// The first lookup of a thunk pushes an update frame; once the thunk reaches a
+// value the cell is overwritten with it, so every other closure sharing that
+// environment sees the value instead of redoing the work.
+Expr *eval_lazy(Expr *expr, Stack *s) {
+  ptrdiff_t base = arrlen(*s);
+  Closure c = {expr, NULL};
+
+  for (;;) {
+    switch (c.term->type) {
+    case EXPR_VAR: {
+      trace(TRACE_LOOKUP, c.term, c.term->var);
+      Env *cell = env_cell(c.env, c.term->var);
+      if (cell->clo.term->type != EXPR_ABS) {
+        arrput(*s, ((Frame){FRAME_UPDATE, {NULL, cell}}));
+        trace(TRACE_PUSH, c.term, arrlen(*s));
+      }
+      stats_depth(arrlen(*s));
+      c = cell->clo;
+      break;
+    }
+    case EXPR_APP:
+      arrput(*s, ((Frame){FRAME_ARG, {c.term->app.arg, c.env}}));
+      stats_depth(arrlen(*s));
+      trace(TRACE_PUSH, c.term, arrlen(*s));
+      c.term = c.term->app.func;
+      break;
+    case EXPR_ABS:
+      while (arrlen(*s) > base && arrlast(*s).type == FRAME_UPDATE) {
+        trace(TRACE_UPDATE, c.term, arrlen(*s));
+        arrpop(*s).clo.env->clo = c;
+      }
+      if (arrlen(*s) == base)
+        return readback(c.term, c.env, 0);
+
+      trace(TRACE_BETA, c.term, arrlen(*s));
+      c = (Closure){c.term->abs.body, env_push(arrpop(*s).clo, c.env)};
+      stats.beta++;
+      break;
+    }
+  }
+}
+
+// Interaction-net reduction with Lamping's algorithm, oracle included, as the
+// sharing graphs of Asperti and Guerrini. A term becomes a graph of nodes with
+// a principal port 0 and one or two auxiliary ports. Every node has a level,
+// the number of application arguments it sits in. λ and application are one
+// binary constructor: a λ's principal port is the term itself, port 1 its
+// variable and port 2 its body; an application's principal port faces its
+// function, port 1 its argument and port 2 its result. The other nodes sit
+// on variable wires, facing the binder: each use of a variable is a croissant
+// at the level of the use, and leaves each argument around it through a
+// bracket, one per variable and argument, where it meets the argument's other
+// uses of that variable through duplicators at the argument's level. An
+// unused variable is plugged with an eraser. When two principal ports meet, the
+// nodes interact. Two constructors annihilate, joining their auxiliary wires
+// pairwise, which is a beta step; so do two duplicators, brackets or
+// croissants of one level. Otherwise the node of lower level, which is never
+// a constructor, passes through the other: it is copied onto the other's
+// auxiliary wires, the other is copied once per auxiliary port of it, and
+// those copies move one level up past a bracket and one down past a
+// croissant. An eraser spreads over the other node. A duplicated λ keeps
+// sharing its body, so no redex is contracted more than once.
+typedef enum {
+  NET_ROOT,
+  NET_ERA,
+  NET_CON,
+  NET_DUP,
+  NET_BRACKET,
+  NET_CROISSANT
+} NetKind;
+
+// A node's kind word holds its NetKind in the low bits and its level above.
+#define NET_KIND(word) ((word) & 7)
+#define NET_LEVEL(word) ((word) >> 3)
+#define NET_AT(kind, level) ((uint32_t)(level) << 3 | (kind))
+#define NET_MAX_LEVEL (UINT32_MAX >> 3)
+
+typedef uint32_t NetPort; // node index << 2 | port number
+#define NET_PORT(node, slot) ((NetPort)(node) << 2 | (slot))
+#define NET_NODE(port) ((port) >> 2)
+#define NET_SLOT(port) ((port) & 3)
+#define NET_NONE ((NetPort)-1)
+
+typedef struct {
+  uint32_t kind; // NET_AT(NetKind, level)
+  NetPort ports[3];
+} NetNode;
+
+typedef struct {
+  NetNode *nodes; // node 0 is the root, its port 0 is wired to the term
+  uint32_t *free; // nodes available for reuse
+  uint64_t steps; // interactions and walk steps taken
+} Net;
+
+// Steps one term may take under --net. Some nets pile up brackets and
+// croissants faster than they resolve them, towers of Church numerals among
+// them, so the reduction gives up past this rather than run on.
+uint64_t net_limit = 1ull << 32;
+
+static inline void net_step(Net *n, uint64_t count) {
+  if ((n->steps += count) > net_limit)
+    ERROR("Interaction net reduction took more than %" PRIu64 " steps",
+          net_limit);
+}
+
+// Number of auxiliary ports of a node of this kind.
+static inline uint32_t net_arity(uint32_t kind) {
+  switch (NET_KIND(kind)) {
+  case NET_CON:
+  case NET_DUP:
+    return 2;
+  case NET_BRACKET:
+  case NET_CROISSANT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static uint32_t net_node(Net *n, uint32_t kind) {
+  uint32_t i;
+  if (arrlen(n->free) > 0) {
+    i = arrpop(n->free);
+  } else {
+    i = arrlenu(n->nodes);
+    if (i >= 1u << 30)
+      ERROR("Interaction net too large");
+    arrput(n->nodes, (NetNode){0});
+  }
+  n->nodes[i] = (NetNode){kind, {NET_NONE, NET_NONE, NET_NONE}};
+  return i;
+}
+
+static inline NetPort net_enter(const Net *n, NetPort p) {
+  return n->nodes[NET_NODE(p)].ports[NET_SLOT(p)];
+}
+
+static inline void net_link(Net *n, NetPort a, NetPort b) {
+  n->nodes[NET_NODE(a)].ports[NET_SLOT(a)] = b;
+  n->nodes[NET_NODE(b)].ports[NET_SLOT(b)] = a;
+}
+
+// Rewrite the active pair of `a` and `b`, whose principal ports are linked.
+// The outer wires are moved one at a time, reading each neighbour only once
+// the previous one is in place, so a wire from one auxiliary port of the pair
+// to another comes out right.
+static void net_interact(Net *n, uint32_t a, uint32_t b) {
+  uint32_t ka = n->nodes[a].kind, kb = n->nodes[b].kind;
+  // Put the node that spreads over the other in `a`: an eraser, else the one
+  // of lower level.
+  if (NET_KIND(kb) == NET_ERA ||
+      (NET_KIND(ka) != NET_ERA && NET_LEVEL(kb) < NET_LEVEL(ka))) {
+    uint32_t t = a;
+    a = b, b = t, t = ka, ka = kb, kb = t;
+  }
+  uint32_t ra = net_arity(ka), rb = net_arity(kb);
+
+  if (NET_KIND(ka) == NET_ERA) {
+    for (uint32_t i = 1; i <= rb; i++)
+      net_link(n, net_enter(n, NET_PORT(b, i)),
+               NET_PORT(net_node(n, NET_AT(NET_ERA, 0)), 0));
+  } else if (NET_KIND(ka) == NET_KIND(kb) &&
+             (NET_KIND(ka) == NET_CON || ka == kb)) {
+    for (uint32_t i = 1; i <= ra; i++)
+      net_link(n, net_enter(n, NET_PORT(a, i)), net_enter(n, NET_PORT(b, i)));
+  } else if (NET_LEVEL(ka) == NET_LEVEL(kb) &&
+             NET_KIND(ka) + NET_KIND(kb) == NET_BRACKET + NET_CROISSANT) {
+    // An empty level added and split again: two empty levels added, by a
+    // croissant where the croissant was and one a level up past it.
+    if (NET_KIND(ka) == NET_BRACKET) {
+      uint32_t t = a;
+      a = b, b = t;
+    }
+    uint32_t up = net_node(n, NET_AT(NET_CROISSANT, NET_LEVEL(ka) + 1));
+    net_link(n, NET_PORT(up, 0), net_enter(n, NET_PORT(b, 1)));
+    uint32_t c = net_node(n, NET_AT(NET_CROISSANT, NET_LEVEL(ka)));
+    net_link(n, NET_PORT(c, 0), NET_PORT(up, 1));
+    net_link(n, NET_PORT(c, 1), net_enter(n, NET_PORT(a, 1)));
+  } else {
+    if (NET_KIND(ka) == NET_CON || NET_LEVEL(ka) == NET_LEVEL(kb))
+      ERROR("Interaction net lost track of levels");
+    if (NET_KIND(ka) == NET_BRACKET) {
+      if (NET_LEVEL(kb) == NET_MAX_LEVEL)
+        ERROR("Interaction net too deep");
+      kb += NET_AT(0, 1);
+    } else if (NET_KIND(ka) == NET_CROISSANT) {
+      kb -= NET_AT(0, 1);
+    }
+    // Copy each node onto the other's auxiliary wires: copy i of `a` goes
+    // where port i of `b` led, and port j of it meets copy j of `b`.
+    uint32_t ca[2], cb[2];
+    for (uint32_t i = 0; i < rb; i++)
+      ca[i] = net_node(n, ka);
+    for (uint32_t j = 0; j < ra; j++)
+      cb[j] = net_node(n, kb);
+    for (uint32_t i = 0; i < rb; i++)
+      for (uint32_t j = 0; j < ra; j++)
+        net_link(n, NET_PORT(ca[i], j + 1), NET_PORT(cb[j], i + 1));
+    for (uint32_t i = 0; i < rb; i++)
+      net_link(n, net_enter(n, NET_PORT(b, i + 1)), NET_PORT(ca[i], 0));
+    for (uint32_t j = 0; j < ra; j++)
+      net_link(n, net_enter(n, NET_PORT(a, j + 1)), NET_PORT(cb[j], 0));
+  }
+  arrput(n->free, a);
+  arrput(n->free, b);
+}
+
+// Join a use of a variable to `var`, the binder's variable port or a door of
+// an argument, through a duplicator at `level` if it is already taken.
+static void net_share(Net *n, NetPort var, uint32_t level, NetPort use) {
+  NetPort prev = net_enter(n, var);
+  if (prev != NET_NONE) {
+    uint32_t dup = net_node(n, NET_AT(NET_DUP, level));
+    net_link(n, NET_PORT(dup, 0), var);
+    net_link(n, NET_PORT(dup, 1), prev);
+    var = NET_PORT(dup, 2);
+  }
+  net_link(n, var, use);
+}
+
+// Wire `expr`, closed by `open` extra λs, to the root of an empty net. An
+// argument is a box one level up whose free variables leave it by a door, a
+// bracket, so its uses of a variable are joined inside it: the net grows
+// with the term, not with the depth of uses below their binders.
+static void net_from_expr(Net *n, Expr *expr, Variable open) {
+  typedef struct {
+    Expr *expr; // NULL closes the innermost binder, or box with `box`
+    NetPort dest;
+    uint32_t level;
+    bool box; // an argument, opening a box
+  } NetTask;
+  typedef struct {
+    uint32_t key; // λ node
+    uint32_t value; // bracket its variable leaves the box by
+  } NetDoor;
+
+  NetTask *todo = NULL;
+  uint32_t *scope = NULL; // λ node of each binder, innermost last
+  NetDoor **boxes = NULL; // doors of each open argument, one per level
+  NetPort dest = NET_PORT(net_node(n, NET_AT(NET_ROOT, 0)), 0);
+  for (Variable i = 0; i < open; i++) {
+    uint32_t lam = net_node(n, NET_AT(NET_CON, 0));
+    net_link(n, NET_PORT(lam, 0), dest);
+    arrput(scope, lam);
+    dest = NET_PORT(lam, 2);
+  }
+  arrput(todo, ((NetTask){expr, dest, 0, false}));
+
+  while (arrlen(todo) > 0) {
+    NetTask t = arrpop(todo);
+    if (!t.expr && t.box) {
+      hmfree(arrlast(boxes));
+      arrsetlen(boxes, arrlen(boxes) - 1);
+      continue;
+    }
+    if (!t.expr) {
+      uint32_t lam = arrpop(scope);
+      if (net_enter(n, NET_PORT(lam, 1)) == NET_NONE)
+        net_link(n, NET_PORT(lam, 1),
+                 NET_PORT(net_node(n, NET_AT(NET_ERA, 0)), 0));
+      continue;
+    }
+    if (t.box)
+      arrput(boxes, NULL);
+    switch (t.expr->type) {
+    case EXPR_VAR: {
+      // A croissant at the level of the use, then out through the door of
+      // each box between it and the binder, made on its first use.
+      uint32_t lam = scope[arrlen(scope) - t.expr->var];
+      uint32_t bound = NET_LEVEL(n->nodes[lam].kind);
+      uint32_t node = net_node(n, NET_AT(NET_CROISSANT, t.level));
+      net_link(n, NET_PORT(node, 1), t.dest);
+      NetPort use = NET_PORT(node, 0), var = NET_PORT(lam, 1);
+      uint32_t level = t.level;
+      for (; level > bound; level--) {
+        ptrdiff_t door = hmgeti(boxes[level - 1], lam);
+        if (door >= 0) {
+          var = NET_PORT(boxes[level - 1][door].value, 1);
+          break;
+        }
+        uint32_t bracket = net_node(n, NET_AT(NET_BRACKET, level - 1));
+        hmput(boxes[level - 1], lam, bracket);
+        net_link(n, NET_PORT(bracket, 1), use);
+        use = NET_PORT(bracket, 0);
+      }
+      net_share(n, var, level, use);
+      break;
+    }
+    case EXPR_ABS: {
+      uint32_t lam = net_node(n, NET_AT(NET_CON, t.level));
+      net_link(n, NET_PORT(lam, 0), t.dest);
+      arrput(scope, lam);
+      arrput(todo, ((NetTask){NULL, 0, 0, false}));
+      arrput(todo, ((NetTask){t.expr->abs.body, NET_PORT(lam, 2), t.level,
+                              false}));
+      break;
+    }
+    case EXPR_APP: {
+      if (t.level == NET_MAX_LEVEL)
+        ERROR("Interaction net too deep");
+      uint32_t app = net_node(n, NET_AT(NET_CON, t.level));
+      net_link(n, NET_PORT(app, 2), t.dest);
+      arrput(todo, ((NetTask){NULL, 0, 0, true}));
+      arrput(todo, ((NetTask){t.expr->app.arg, NET_PORT(app, 1),
+                              t.level + 1, true}));
+      arrput(todo, ((NetTask){t.expr->app.func, NET_PORT(app, 0), t.level,
+                              false}));
+      break;
+    }
+    }
+  }
+  while (arrlen(scope) > 0) {
+    uint32_t lam = arrpop(scope);
+    if (net_enter(n, NET_PORT(lam, 1)) == NET_NONE)
+      net_link(n, NET_PORT(lam, 1),
+               NET_PORT(net_node(n, NET_AT(NET_ERA, 0)), 0));
+  }
+  arrfree(todo);
+  arrfree(scope);
+  arrfree(boxes);
+}
+
+// A bracket `c` whose auxiliary port leads into a croissant at its level or
+// one above, and on into one at its level, pairs up the two empty levels
+// those have just added: the three act as the last croissant alone. Wire
+// that one in their place and return it, or 0 if `c` starts no such chain.
+// Rewrites past brackets leave these chains behind, and a path read over and
+// over would otherwise cross them, and copy them, each time.
+static uint32_t net_fuse(Net *n, uint32_t c) {
+  uint32_t kc = n->nodes[c].kind;
+  if (NET_KIND(kc) != NET_BRACKET)
+    return 0;
+  NetPort pb = net_enter(n, NET_PORT(c, 1));
+  uint32_t b = NET_NODE(pb), kb = n->nodes[b].kind;
+  if (NET_SLOT(pb) != 0 || NET_KIND(kb) != NET_CROISSANT ||
+      NET_LEVEL(kb) - NET_LEVEL(kc) > 1)
+    return 0;
+  NetPort pa = net_enter(n, NET_PORT(b, 1));
+  uint32_t a = NET_NODE(pa);
+  if (NET_SLOT(pa) != 0 ||
+      n->nodes[a].kind != NET_AT(NET_CROISSANT, NET_LEVEL(kc)))
+    return 0;
+  NetPort out = net_enter(n, NET_PORT(c, 0));
+  if (NET_NODE(out) == a || NET_NODE(out) == b || NET_NODE(out) == c)
+    return 0;
+  net_link(n, NET_PORT(a, 0), out);
+  arrput(n->free, b);
+  arrput(n->free, c);
+  return a;
+}
+
+// Reduce the active pairs in the way of reading what is on the other side of
+// `port`. The walk moves towards principal ports, noting on `exits` the port
+// it entered each node by, and goes on from an application's result to its
+// function. When it crosses a wire between two principal ports, that pair
+// interacts and the walk goes back to where it entered the first node. It
+// stops at a node reached at its principal port from an auxiliary one, or at
+// a λ's variable: everything on the way there is then in normal form.
+static void net_settle(Net *n, NetPort port, uint8_t **exits) {
+  arrsetlen(*exits, 0);
+  NetPort at = net_enter(n, port);
+  for (;;) {
+    net_step(n, 1);
+    uint32_t node = NET_NODE(at), kind = n->nodes[node].kind;
+    if (NET_SLOT(at) != 0) {
+      if (NET_KIND(kind) == NET_CON && NET_SLOT(at) == 1)
+        return;
+      uint32_t fused;
+      if (arrlen(*exits) >= 2 && (fused = net_fuse(n, node))) {
+        arrsetlen(*exits, arrlen(*exits) - 1);
+        at = net_enter(n, NET_PORT(fused, 0));
+        continue;
+      }
+      arrput(*exits, NET_SLOT(at));
+      stats_depth(arrlen(*exits));
+      at = net_enter(n, NET_PORT(node, 0));
+      continue;
+    }
+
+    NetPort from = net_enter(n, at);
+    uint32_t other = NET_NODE(from);
+    if (NET_KIND(kind) == NET_ROOT || NET_SLOT(from) != 0 ||
+        NET_KIND(n->nodes[other].kind) == NET_ROOT)
+      return;
+    if (arrlen(*exits) == 0)
+      ERROR("Interaction net has no readable normal form");
+    NetPort back = net_enter(n, NET_PORT(other, arrpop(*exits)));
+    if (NET_KIND(kind) == NET_CON &&
+        NET_KIND(n->nodes[other].kind) == NET_CON) {
+      trace(TRACE_BETA, &n->nodes[node], arrlen(*exits));
+      stats.beta++;
+    }
+    net_interact(n, other, node);
+    at = net_enter(n, back);
+  }
+}
+
+// Read the reduced net back as a term, stripping the `open` λs added around
+// it. The read follows paths through the net carrying a context with one
+// value per level, which tells a shared subterm's copies apart. Crossing a
+// duplicator from an auxiliary port to the principal one records that port
+// at the duplicator's level, and crossing one the other way takes it back
+// out to pick the port to leave by. A bracket crossed towards its principal
+// port pairs the values of its level and the next, taking one level away; a
+// croissant crossed that way adds a level, with an empty value. Crossed the
+// other way they undo this. Values and contexts are immutable lists in
+// eval_arena, shared by the two sides of an application.
+typedef struct NetValue NetValue;
+struct NetValue {
+  uint32_t slot; // port of a duplicator, or 0 for a bracket's pair
+  NetValue *first, *second;
+};
+
+typedef struct NetContext NetContext;
+struct NetContext {
+  NetValue *value; // NULL is the empty value
+  NetContext *next;
+};
+
+static NetValue *net_value(uint32_t slot, NetValue *first, NetValue *second) {
+  if (!slot && !first && !second)
+    return NULL;
+  NetValue *v = arena_alloc(&eval_arena, sizeof(NetValue));
+  *v = (NetValue){slot, first, second};
+  return v;
+}
+
+// Value at `level`: every level past the end of a context is empty.
+static NetValue *net_context_get(NetContext *ctx, uint32_t level) {
+  for (; ctx && level > 0; level--)
+    ctx = ctx->next;
+  return ctx ? ctx->value : NULL;
+}
+
+// `ctx` with `drop` levels from `level` on replaced by the `count` values in
+// `vals`. Levels in front are copied, the rest shared.
+static NetContext *net_context_edit(NetContext *ctx, uint32_t level,
+                                    uint32_t drop, NetValue **vals,
+                                    uint32_t count) {
+  // Past the end every level is empty, and stays so if only empty values
+  // are put there.
+  NetContext *end = ctx;
+  for (uint32_t i = 0; end && i < level; i++)
+    end = end->next;
+  bool empty = !end;
+  for (uint32_t i = 0; empty && i < count; i++)
+    empty = !vals[i];
+  if (empty)
+    return ctx;
+  NetContext *head = NULL, **tail = &head;
+  for (; level > 0; level--) {
+    NetContext *c = arena_alloc(&eval_arena, sizeof(NetContext));
+    *c = (NetContext){ctx ? ctx->value : NULL, NULL};
+    *tail = c, tail = &c->next;
+    ctx = ctx ? ctx->next : NULL;
+  }
+  for (; drop > 0 && ctx; drop--)
+    ctx = ctx->next;
+  for (uint32_t i = 0; i < count; i++) {
+    NetContext *c = arena_alloc(&eval_arena, sizeof(NetContext));
+    *c = (NetContext){vals[i], NULL};
+    *tail = c, tail = &c->next;
+  }
+  *tail = ctx;
+  return head;
+}
+
+// Cross the duplicator, bracket or croissant `kind` from the port `slot`,
+// changing `*ctx`, and return the port to leave by.
+static uint32_t net_cross(NetContext **ctx, uint32_t kind, uint32_t slot) {
+  uint32_t level = NET_LEVEL(kind);
+  NetValue *v = net_context_get(*ctx, level), *vals[2];
+  switch (NET_KIND(kind)) {
+  case NET_DUP:
+    if (slot != 0) {
+      vals[0] = net_value(slot, v, NULL);
+      *ctx = net_context_edit(*ctx, level, 1, vals, 1);
+      return 0;
+    }
+    if (!v || !v->slot)
+      break;
+    *ctx = net_context_edit(*ctx, level, 1, &v->first, 1);
+    return v->slot;
+  case NET_BRACKET:
+    if (slot != 0) {
+      vals[0] = net_value(0, v, net_context_get(*ctx, level + 1));
+      *ctx = net_context_edit(*ctx, level, 2, vals, 1);
+      return 0;
+    }
+    if (v && v->slot)
+      break;
+    vals[0] = v ? v->first : NULL, vals[1] = v ? v->second : NULL;
+    *ctx = net_context_edit(*ctx, level, 1, vals, 2);
+    return 1;
+  case NET_CROISSANT:
+    if (slot != 0) {
+      vals[0] = NULL;
+      *ctx = net_context_edit(*ctx, level, 0, vals, 1);
+      return 0;
+    }
+    if (v)
+      break;
+    *ctx = net_context_edit(*ctx, level, 1, NULL, 0);
+    return 1;
+  }
+  ERROR("Interaction net has no readable normal form");
+}
+
+// Whether contexts `a` and `b` hold the same values at their first `levels`
+// levels. `stack` is scratch space for the walk over values.
+static bool net_context_same(NetContext *a, NetContext *b, uint32_t levels,
+                             NetValue ***stack) {
+  bool same = true;
+  for (; same && levels > 0 && a != b; levels--) {
+    arrsetlen(*stack, 0);
+    arrput(*stack, a ? a->value : NULL);
+    arrput(*stack, b ? b->value : NULL);
+    while (same && arrlen(*stack) > 0) {
+      NetValue *y = arrpop(*stack), *x = arrpop(*stack);
+      if (x == y)
+        continue;
+      if (!x || !y || x->slot != y->slot) {
+        same = false;
+        break;
+      }
+      arrput(*stack, x->first);
+      arrput(*stack, y->first);
+      arrput(*stack, x->second);
+      arrput(*stack, y->second);
+    }
+    a = a ? a->next : NULL;
+    b = b ? b->next : NULL;
+  }
+  return same;
+}
+
+// A λ node is copied by the nodes of lower level that pass through it, so
+// one node can stand for several binders, told apart by the context below
+// its level: a variable is bound by the innermost copy of its λ node being
+// read whose context agrees with its own there.
+typedef struct {
+  NetContext *ctx; // context the λ was entered with
+  Variable depth;  // binder depth + 1
+  uint32_t outer;  // index + 1 of the next copy of the node out, or 0
+} NetBinder;
+
+// Index + 1 in `binders` of the copy that binds in context `ctx`, among the
+// copies of a λ node at `level` from the one at index + 1 `i` outwards; 0 if
+// there is none.
+static uint32_t net_binder(const NetBinder *binders, uint32_t i,
+                           NetContext *ctx, uint32_t level,
+                           NetValue ***stack) {
+  for (; i > 0; i = binders[i - 1].outer)
+    if (net_context_same(binders[i - 1].ctx, ctx, level, stack))
+      return i;
+  return 0;
+}
+
+static Expr *net_readback(Net *n, Variable open) {
+  typedef enum { NET_READ, NET_MAKE_ABS, NET_MAKE_APP } NetOp;
+  typedef struct {
+    NetOp op;
+    NetPort port; // read what is on the other side of this port
+    NetContext *ctx;
+    Variable depth;
+  } NetRead;
+
+  NetRead *todo = NULL;
+  Expr **vals = NULL;
+  uint8_t *exits = NULL;
+  NetBinder *binders = NULL; // λs being read, innermost last
+  uint32_t *inner = NULL; // index + 1 of each λ node's innermost copy, or 0
+  NetValue **stack = NULL;
+  arrput(todo, ((NetRead){NET_READ, NET_PORT(0, 0), NULL, 0}));
+
+  while (arrlen(todo) > 0) {
+    NetRead t = arrpop(todo);
+    if (t.op == NET_MAKE_ABS) {
+      inner[NET_NODE(t.port)] = arrpop(binders).outer;
+      arrlast(vals) = new_abs(arrlast(vals));
+      continue;
+    }
+    if (t.op == NET_MAKE_APP) {
+      Expr *arg = arrpop(vals);
+      arrlast(vals) = new_app(arrlast(vals), arg);
+      continue;
+    }
+
+    net_step(n, 1);
+    if (NET_SLOT(t.port) != 0 || NET_NODE(t.port) == 0)
+      net_settle(n, t.port, &exits);
+    NetPort at = net_enter(n, t.port);
+    uint32_t node = NET_NODE(at), kind = n->nodes[node].kind;
+    switch (NET_KIND(kind)) {
+    case NET_CON:
+      if (NET_SLOT(at) == 0) {
+        while (arrlenu(inner) <= node)
+          arrput(inner, 0);
+        if (net_binder(binders, inner[node], t.ctx, NET_LEVEL(kind), &stack))
+          ERROR("Interaction net reads a λ inside itself");
+        arrput(binders, ((NetBinder){t.ctx, t.depth + 1, inner[node]}));
+        inner[node] = arrlen(binders);
+        arrput(todo, ((NetRead){NET_MAKE_ABS, at, NULL, 0}));
+        arrput(todo, ((NetRead){NET_READ, NET_PORT(node, 2), t.ctx,
+                                t.depth + 1}));
+      } else if (NET_SLOT(at) == 1) {
+        uint32_t b = 0;
+        if (arrlenu(inner) > node)
+          b = net_binder(binders, inner[node], t.ctx, NET_LEVEL(kind), &stack);
+        if (!b)
+          ERROR("Interaction net has no readable normal form");
+        arrput(vals, new_var(t.depth - binders[b - 1].depth + 1));
+      } else {
+        arrput(todo, ((NetRead){NET_MAKE_APP, 0, NULL, 0}));
+        arrput(todo,
+               ((NetRead){NET_READ, NET_PORT(node, 1), t.ctx, t.depth}));
+        arrput(todo,
+               ((NetRead){NET_READ, NET_PORT(node, 0), t.ctx, t.depth}));
+      }
+      break;
+    case NET_DUP:
+    case NET_BRACKET:
+    case NET_CROISSANT: {
+      NetContext *ctx = t.ctx;
+      uint32_t slot = net_cross(&ctx, kind, NET_SLOT(at));
+      arrput(todo,
+             ((NetRead){NET_READ, NET_PORT(node, slot), ctx, t.depth}));
+      break;
+    }
+    default:
+      ERROR("Interaction net has no readable normal form");
+    }
+  }
+
+  Expr *res = vals[0];
+  for (Variable i = 0; i < open; i++)
+    res = res->abs.body;
+  arrfree(todo);
+  arrfree(vals);
+  arrfree(exits);
+  arrfree(binders);
+  arrfree(inner);
+  arrfree(stack);
+  return res;
+}
+
+// Normal form of `expr` by interaction-net reduction, on the calling thread
+// alone: --threads does not apply to it.
+Expr *net_normalize(Expr *expr) {
+  Net n = {0};
+  Variable open = expr_open_depth(expr);
+  net_from_expr(&n, expr, open);
+  Expr *res = net_readback(&n, open);
+  arrfree(n.nodes);
+  arrfree(n.free);
+  return res;
+}
+
+// Bytecode for the Krivine machine. A term compiles to a contiguous block:
+//   x_n   => ACCESS n
+//   λ t   => GRAB; [t]
+//   t u   => PUSH L; [t]; L: [u]
+// Before its first run the program is rewritten in place into direct-threaded
+// code, each opcode replaced by the address of its handler in vm_eval.
+typedef enum { OP_ACCESS, OP_GRAB, OP_PUSH } OpCode;
+
+typedef union {
+  uintptr_t op;
+  uintptr_t arg;
+  void *label;
+} Insn;
+
+typedef struct {
+  Insn *code;
+  Expr **src; // term whose code starts at each offset, NULL elsewhere
+  bool threaded;
+} Program;
+
+typedef struct VmEnv VmEnv;
+
+typedef struct {
+  const Insn *pc;
+  VmEnv *env;
+} VmClosure;
+
+struct VmEnv {
+  VmClosure clo;
+  VmEnv *next;
+};
+
+static void emit(Program *p, uintptr_t word, Expr *src) {
+  arrput(p->code, ((Insn){.op = word}));
+  arrput(p->src, src);
+}
+
+Program compile(Expr *expr) {
+  typedef struct {
+    Expr *expr;
+    size_t patch;
+  } Pending;
+
+  Program p = {0};
+  Pending *todo = NULL;
+  arrput(todo, ((Pending){expr, 0}));
+
+  while (arrlen(todo) > 0) {
+    Pending t = arrpop(todo);
+    if (t.patch)
+      p.code[t.patch].arg = arrlenu(p.code);
+
+    for (Expr *e = t.expr;;) {
+      if (e->type == EXPR_VAR) {
+        emit(&p, OP_ACCESS, e);
+        emit(&p, e->var, NULL);
+        break;
+      }
+      if (e->type == EXPR_ABS) {
+        emit(&p, OP_GRAB, e);
+        e = e->abs.body;
+      } else {
+        emit(&p, OP_PUSH, e);
+        arrput(todo, ((Pending){e->app.arg, arrlenu(p.code)}));
+        emit(&p, 0, NULL);
+        e = e->app.func;
+      }
+    }
+  }
+
+  arrfree(todo);
+  return p;
+}
+
+void program_free(Program *p) {
+  arrfree(p->code);
+  arrfree(p->src);
+}
+
+typedef struct {
+  VmEnv *key;
+  Env *value;
+} VmEnvMemo;
+
+// Each environment is converted after the ones it refers to, on an explicit
+// stack, since the chain of `next` links is as long as the environment.
+static Env *_vm_env_to_env(const Program *p, VmEnv *env, VmEnvMemo **seen) {
+  if (!env)
+    return NULL;
+  VmEnv **todo = NULL;
+  arrput(todo, env);
+  while (arrlen(todo) > 0) {
+    VmEnv *e = arrlast(todo);
+    if (hmgeti(*seen, e) >= 0) {
+      arrsetlen(todo, arrlen(todo) - 1);
+      continue;
+    }
+    ptrdiff_t clo_env = e->clo.env ? hmgeti(*seen, e->clo.env) : 0;
+    ptrdiff_t next = e->next ? hmgeti(*seen, e->next) : 0;
+    if (clo_env < 0)
+      arrput(todo, e->clo.env);
+    if (next < 0)
+      arrput(todo, e->next);
+    if (clo_env < 0 || next < 0)
+      continue;
+    Closure clo = {p->src[e->clo.pc - p->code],
+                   e->clo.env ? (*seen)[clo_env].value : NULL};
+    hmput(*seen, e, env_push(clo, e->next ? (*seen)[next].value : NULL));
+    arrsetlen(todo, arrlen(todo) - 1);
+  }
+  arrfree(todo);
+  return hmget(*seen, env);
+}
+
+VmEnv *vm_env_push(VmClosure clo, VmEnv *next) {
+  VmEnv *env = arena_alloc(&eval_arena, sizeof(VmEnv));
+  env->clo = clo;
+  env->next = next;
+  return env;
+}
+
+// Read back the value reached when the GRAB at `pc` found an empty stack.
+Expr *vm_readback(const Program *p, const Insn *pc, VmEnv *env) {
+  VmEnvMemo *seen = NULL;
+  Env *res_env = _vm_env_to_env(p, env, &seen);
+  hmfree(seen);
+  return readback(p->src[pc - p->code], res_env, 0);
+}
+
+// Run a compiled program to weak head normal form and read the result back.
+Expr *vm_eval(Program *p) {
+  static void *const labels[] = {
+      [OP_ACCESS] = &&op_access,
+      [OP_GRAB] = &&op_grab,
+      [OP_PUSH] = &&op_push,
+  };
+
+  if (!p->threaded) {
+    for (ptrdiff_t i = 0; i < arrlen(p->code); i++) {
+      OpCode op = p->code[i].op;
+      p->code[i].label = labels[op];
+      if (op != OP_GRAB)
+        i++;
+    }
+    p->threaded = true;
+  }
+
+  VmClosure *stack = NULL;
+  const Insn *pc = p->code;
+  VmEnv *env = NULL;
+
+#define DISPATCH() goto *(pc++)->label
+
+  DISPATCH();
+
+op_access: {
+  stats.lookups++;
+  trace(TRACE_LOOKUP, p->src[pc - 1 - p->code], pc->arg);
+  VmEnv *e = env;
+  for (uintptr_t i = pc->arg; i > 1 && e; i--)
+    e = e->next;
+  if (!e)
+    ERROR("Variable %lu not found in environment", (unsigned long)pc->arg);
+  pc = e->clo.pc;
+  env = e->clo.env;
+  DISPATCH();
+}
+
+op_push:
+  arrput(stack, ((VmClosure){p->code + pc->arg, env}));
+  stats_depth(arrlen(stack));
+  trace(TRACE_PUSH, p->src[pc - 1 - p->code], arrlen(stack));
+  pc++;
+  DISPATCH();
+
+op_grab:
+  if (arrlen(stack) > 0) {
+    trace(TRACE_BETA, p->src[pc - 1 - p->code], arrlen(stack));
+    env = vm_env_push(arrpop(stack), env);
+    stats.beta++;
+    DISPATCH();
+  }
+
+#undef DISPATCH
+
+  arrfree(stack);
+  return vm_readback(p, pc - 1, env);
+}
+
+// x86-64 JIT for the Krivine bytecode. Closures and environments are the
+// VM's, with bytecode addresses as code pointers; a table maps each bytecode
+// offset to its native entry point. Generated code keeps the machine in
+// callee-saved registers:
+//   rbx  JitState       r12  current environment
+//   r13  native table   r14  bytecode base        r15  stack pointer
+// ACCESS walks the environment and jumps through the table, PUSH stores a
+// closure inline, and GRAB calls jit_bind to allocate the environment cell.
+// Open terms and other architectures run on vm_eval instead.
+typedef struct {
+  VmClosure *base;
+  VmClosure *sp;
+  VmClosure *limit;
+  VmEnv *env;
+  const Insn *pc; // GRAB that found the stack empty
+  const Insn *code;
+  void **native;
+} JitState;
+
+typedef struct {
+  Program prog;
+  void **native;
+  unsigned char *mem;
+  size_t size;
+} JitCode;
+
+static VmEnv *jit_bind(JitState *st, const VmClosure *clo, VmEnv *env) {
+  // The stack only shrinks here, so its deepest point is always seen.
+  stats_depth(clo - st->base + 1);
+  stats.beta++;
+  return vm_env_push(*clo, env);
+}
+
+static VmClosure *jit_grow(JitState *st, VmClosure *sp) {
+  size_t len = sp - st->base;
+  size_t cap = st->limit - st->base;
+  cap = cap ? 2 * cap : 64;
+  st->base = realloc(st->base, cap * sizeof(VmClosure));
+  if (!st->base)
+    ERROR("Memory allocation failed");
+  st->limit = st->base + cap;
+  return st->base + len;
+}
+
+#if defined(__x86_64__)
+
+_Static_assert(sizeof(Insn) == sizeof(void *),
+               "bytecode and native table offsets must coincide");
+
+#define JIT_BYTES(...)                                                         \
+  out = jit_imm(out, (const unsigned char[]){__VA_ARGS__},                     \
+                sizeof((const unsigned char[]){__VA_ARGS__}))
+#define JIT_OFF(field) ((unsigned char)offsetof(JitState, field))
+
+static unsigned char *jit_imm(unsigned char *out, const void *src, size_t n) {
+  memcpy(out, src, n);
+  return out + n;
+}
+
+static unsigned char *jit_imm64(unsigned char *out, uint64_t imm) {
+  return jit_imm(out, &imm, 8);
+}
+
+static unsigned char *jit_call(unsigned char *out, const void *fn) {
+  JIT_BYTES(0x48, 0xb8); // mov rax, imm64
+  out = jit_imm64(out, (uint64_t)fn);
+  JIT_BYTES(0xff, 0xd0); // call rax
+  return out;
+}
+
+bool jit_compile(Expr *expr, JitCode *jit) {
+  if (expr_open_depth(expr))
+    return false;
+
+  Program p = compile(expr);
+  size_t len = arrlenu(p.code);
+  // Bytes emitted below: entry and exit, then each instruction.
+  size_t size = 48;
+  for (size_t i = 0; i < len; i++) {
+    switch (p.code[i].op) {
+    case OP_GRAB:
+      size += 53;
+      break;
+    case OP_PUSH:
+      size += 48, i++;
+      break;
+    case OP_ACCESS:
+      size += 25 + 5 * p.code[++i].arg;
+      break;
+    }
+  }
+
+  unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    program_free(&p);
+    return false;
+  }
+  void **native = calloc(len, sizeof(void *));
+  if (!native)
+    ERROR("Memory allocation failed");
+
+  unsigned char *out = mem;
+  // Entry: void (*)(JitState *st, void *target)
+  JIT_BYTES(0x53);                               // push rbx
+  JIT_BYTES(0x41, 0x54);                         // push r12
+  JIT_BYTES(0x41, 0x55);                         // push r13
+  JIT_BYTES(0x41, 0x56);                         // push r14
+  JIT_BYTES(0x41, 0x57);                         // push r15
+  JIT_BYTES(0x48, 0x89, 0xfb);                   // mov rbx, rdi
+  JIT_BYTES(0x4c, 0x8b, 0x63, JIT_OFF(env));     // mov r12, [rbx+env]
+  JIT_BYTES(0x4c, 0x8b, 0x6b, JIT_OFF(native));  // mov r13, [rbx+native]
+  JIT_BYTES(0x4c, 0x8b, 0x73, JIT_OFF(code));    // mov r14, [rbx+code]
+  JIT_BYTES(0x4c, 0x8b, 0x7b, JIT_OFF(sp));      // mov r15, [rbx+sp]
+  JIT_BYTES(0xff, 0xe6);                         // jmp rsi
+  unsigned char *leave = out;
+  JIT_BYTES(0x4c, 0x89, 0x63, JIT_OFF(env)); // mov [rbx+env], r12
+  JIT_BYTES(0x4c, 0x89, 0x7b, JIT_OFF(sp));  // mov [rbx+sp], r15
+  JIT_BYTES(0x41, 0x5f);                     // pop r15
+  JIT_BYTES(0x41, 0x5e);                     // pop r14
+  JIT_BYTES(0x41, 0x5d);                     // pop r13
+  JIT_BYTES(0x41, 0x5c);                     // pop r12
+  JIT_BYTES(0x5b);                           // pop rbx
+  JIT_BYTES(0xc3);                           // ret
+
+  for (size_t i = 0; i < len; i++) {
+    native[i] = out;
+    switch (p.code[i].op) {
+    case OP_GRAB: {
+      JIT_BYTES(0x4c, 0x3b, 0x7b, JIT_OFF(base)); // cmp r15, [rbx+base]
+      JIT_BYTES(0x75, 19);                        // jne bind
+      JIT_BYTES(0x48, 0xb8);                      // mov rax, imm64
+      out = jit_imm64(out, (uint64_t)(p.code + i));
+      JIT_BYTES(0x48, 0x89, 0x43, JIT_OFF(pc)); // mov [rbx+pc], rax
+      JIT_BYTES(0xe9);                          // jmp leave
+      int32_t rel = (int32_t)(leave - (out + 4));
+      out = jit_imm(out, &rel, 4);
+      // bind:
+      JIT_BYTES(0x49, 0x83, 0xef, 0x10); // sub r15, 16
+      JIT_BYTES(0x48, 0x89, 0xdf);       // mov rdi, rbx
+      JIT_BYTES(0x4c, 0x89, 0xfe);       // mov rsi, r15
+      JIT_BYTES(0x4c, 0x89, 0xe2);       // mov rdx, r12
+      out = jit_call(out, jit_bind);
+      JIT_BYTES(0x49, 0x89, 0xc4); // mov r12, rax
+      break;
+    }
+    case OP_PUSH:
+      JIT_BYTES(0x4c, 0x3b, 0x7b, JIT_OFF(limit)); // cmp r15, [rbx+limit]
+      JIT_BYTES(0x72, 21);                         // jb push
+      JIT_BYTES(0x48, 0x89, 0xdf);                 // mov rdi, rbx
+      JIT_BYTES(0x4c, 0x89, 0xfe);                 // mov rsi, r15
+      out = jit_call(out, jit_grow);
+      JIT_BYTES(0x49, 0x89, 0xc7); // mov r15, rax
+      // push:
+      JIT_BYTES(0x48, 0xb8); // mov rax, imm64
+      out = jit_imm64(out, (uint64_t)(p.code + p.code[++i].arg));
+      JIT_BYTES(0x49, 0x89, 0x07);       // mov [r15], rax
+      JIT_BYTES(0x4d, 0x89, 0x67, 0x08); // mov [r15+8], r12
+      JIT_BYTES(0x49, 0x83, 0xc7, 0x10); // add r15, 16
+      break;
+    case OP_ACCESS:
+      JIT_BYTES(0x48, 0xb8); // mov rax, imm64
+      out = jit_imm64(out, (uint64_t)&stats.lookups);
+      JIT_BYTES(0x48, 0xff, 0x00); // inc qword [rax]
+      for (uintptr_t n = p.code[++i].arg; n > 1; n--)
+        JIT_BYTES(0x4d, 0x8b, 0x64, 0x24, 0x10); // mov r12, [r12+16]
+      JIT_BYTES(0x49, 0x8b, 0x04, 0x24);         // mov rax, [r12]
+      JIT_BYTES(0x4d, 0x8b, 0x64, 0x24, 0x08);   // mov r12, [r12+8]
+      JIT_BYTES(0x4c, 0x29, 0xf0);               // sub rax, r14
+      JIT_BYTES(0x41, 0xff, 0x64, 0x05, 0x00);   // jmp [r13+rax]
+      break;
+    }
+  }
+  if ((size_t)(out - mem) != size)
+    ERROR("JIT emitted %zu bytes for %zu", (size_t)(out - mem), size);
+
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+    munmap(mem, size);
+    free(native);
+    program_free(&p);
+    return false;
+  }
+
+  *jit = (JitCode){p, native, mem, size};
+  return true;
+}
+
+#undef JIT_OFF
+#undef JIT_BYTES
+
+Expr *jit_run(JitCode *jit) {
+  JitState st = {.code = jit->prog.code, .native = jit->native};
+  st.sp = jit_grow(&st, NULL);
+  ((void (*)(JitState *, void *))jit->mem)(&st, jit->native[0]);
+  free(st.base);
+  return vm_readback(&jit->prog, st.pc, st.env);
+}
+
+void jit_free(JitCode *jit) {
+  munmap(jit->mem, jit->size);
+  free(jit->native);
+  program_free(&jit->prog);
+}
+#else
+bool jit_compile(Expr *expr, JitCode *jit) {
+  (void)expr;
+  (void)jit;
+  return false;
+}
+
+Expr *jit_run(JitCode *jit) { return vm_eval(&jit->prog); }
+
+void jit_free(JitCode *jit) { program_free(&jit->prog); }
+#endif
+
+// Terms run on the VM until they have been evaluated `jit_threshold` times,
+// after which they are compiled to native code; 0 compiles on first use.
+// Entries are keyed by structural hash, so copies of one term parsed apart
+// count together. A term whose hash is held by a different one runs on the
+// VM uncached.
+typedef struct {
+  Expr *expr; // the term the entry was compiled from
+  Program prog;
+  JitCode jit;
+  unsigned hits;
+  bool compiled; // jit holds native code
+  bool failed;   // the JIT gave up on this term
+} JitEntry;
+
+unsigned jit_threshold = 16;
+struct {
+  uint64_t key;
+  JitEntry value;
+} *jit_cache = NULL;
+
+Expr *jit_eval(Expr *expr) {
+  uint64_t hash = expr_hash(expr);
+  ptrdiff_t i = hmgeti(jit_cache, hash);
+  if (i < 0) {
+    hmput(jit_cache, hash,
+          ((JitEntry){.expr = expr, .prog = compile(expr)}));
+    i = hmgeti(jit_cache, hash);
+  } else if (!expr_equal(jit_cache[i].value.expr, expr)) {
+    Program p = compile(expr);
+    Expr *res = vm_eval(&p);
+    program_free(&p);
+    return res;
+  }
+
+  JitEntry *e = &jit_cache[i].value;
+  if (!e->compiled && !e->failed && ++e->hits > jit_threshold) {
+    e->compiled = jit_compile(expr, &e->jit);
+    e->failed = !e->compiled;
+  }
+  return e->compiled ? jit_run(&e->jit) : vm_eval(&e->prog);
+}
+
+// Drop the compiled code of one term, e.g. before the term is released. An
+// entry compiled from another copy of the term stays.
+void jit_forget(Expr *expr) {
+  uint64_t hash = expr_hash(expr);
+  ptrdiff_t i = hmgeti(jit_cache, hash);
+  if (i < 0 || jit_cache[i].value.expr != expr)
+    return;
+  program_free(&jit_cache[i].value.prog);
+  if (jit_cache[i].value.compiled)
+    jit_free(&jit_cache[i].value.jit);
+  (void)hmdel(jit_cache, hash);
+}
+
+// Drop every compiled term. Must be called before the terms are freed.
+void jit_reset(void) {
+  for (ptrdiff_t i = 0; i < hmlen(jit_cache); i++) {
+    program_free(&jit_cache[i].value.prog);
+    if (jit_cache[i].value.compiled)
+      jit_free(&jit_cache[i].value.jit);
+  }
+  hmfree(jit_cache);
+}
+
+typedef enum {
+  ENGINE_EVAL,
+  ENGINE_KRIVINE,
+  ENGINE_LAZY,
+  ENGINE_VM,
+  ENGINE_JIT,
+  ENGINE_NORMALIZE,
+  ENGINE_NET
+} Engine;
+
+void stats_print(FILE *f, bool json) {
+  static const char *phases[] = {"load", "eval", "print"};
+  fprintf(f,
+          json ? "{\"beta\": %" PRIu64 ", \"lookups\": %" PRIu64
+                 ", \"max_depth\": %" PRIu64 ", \"nodes\": %" PRIu64
+                 ", \"realloc_bytes\": %" PRIu64 ", \"gc\": {\"count\": %" PRIu64
+                 ", \"reclaimed_bytes\": %" PRIu64
+                 ", \"pause\": %.6f, \"max_pause\": %.6f}, \"cache\": "
+                 "{\"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+                 "}, \"time\": {"
+               : "beta=%" PRIu64 " lookups=%" PRIu64 " max_depth=%" PRIu64
+                 " nodes=%" PRIu64 " realloc_bytes=%" PRIu64 " gc=%" PRIu64
+                 " gc_reclaimed=%" PRIu64 " gc_pause=%.6fs gc_max_pause=%.6fs"
+                 " cache_hits=%" PRIu64 " cache_misses=%" PRIu64,
+          stats.beta, stats.lookups, stats.max_depth, stats.nodes,
+          stats.realloc_bytes, stats.gc_count, stats.gc_reclaimed,
+          stats.gc_pause, stats.gc_max_pause, stats.cache_hits,
+          stats.cache_misses);
+  for (int i = 0; i < PHASE_COUNT; i++)
+    fprintf(f, json ? "%s\"%s\": %.6f" : " %s%s=%.6fs",
+            json && i ? ", " : "", phases[i], stats.time[i]);
+  fputs(json ? "}}\n" : "\n", f);
+}
+
+Expr *run(Engine engine, Expr *expr, Stack *s) {
+  switch (engine) {
+  case ENGINE_KRIVINE:
+    return krivine(expr);
+  case ENGINE_LAZY:
+    return eval_lazy(expr, s);
+  case ENGINE_VM: {
+    Program p = compile(expr);
+    Expr *res = vm_eval(&p);
+    program_free(&p);
+    return res;
+  }
+  case ENGINE_JIT:
+    return jit_eval(expr);
+  case ENGINE_NORMALIZE:
+    return normalize_parallel(expr);
+  case ENGINE_NET:
+    return net_normalize(expr);
+  default:
+    return eval(expr, s);
+  }
+}
+
+// Persistent result cache, opened with cache_open (--cache=FILE). It maps an
+// engine and an input term to that engine's result, so a term evaluated by an
+// earlier run is decoded instead of reduced. The file is a header, an open
+// addressing table of slots, then a data area holding each entry's key (the
+// engine as one byte, then the term in BLC) followed by its result in BLC. It
+// is mapped shared and updated in place; integers are little-endian.
+//
+// The data area has a fixed size and entries are only ever appended, so it
+// never holds garbage. When an entry does not fit, the least recently used
+// ones are dropped until 1/8 of the area and half the free slots are free
+// again, the survivors are slid down to close the gaps and the table is
+// rebuilt. Every lookup and store holds an exclusive file lock, so several
+// processes can share one cache; a mutex guards it between threads.
+#define CACHE_MAGIC "LCCACHE"
+#define CACHE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_count; // a power of two, at most half of them in use
+  uint64_t data_size;
+  uint64_t data_used;
+  uint64_t entries;
+  uint64_t clock; // ticks on every hit and insertion
+} CacheHeader;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t offset;   // of the key in the data area; the result follows it
+  uint32_t key_size; // 0 for an empty slot
+  uint32_t value_size;
+  uint64_t used; // clock at the last hit
+} CacheSlot;
+
+typedef struct {
+  CacheHeader *header;
+  CacheSlot *slots;
+  uint8_t *data;
+  size_t size;
+  int fd;
+  pthread_mutex_t lock;
+} Cache;
+
+Cache result_cache = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Size of the data area of a new cache; an existing one keeps its own.
+size_t cache_size = 64 << 20;
+
+typedef struct {
+  uint64_t hash;
+  uint8_t *bytes; // stb_ds array
+} CacheKey;
+
+CacheKey cache_key(Engine engine, const Expr *expr) {
+  BitWriter w = {0};
+  bits_put(&w, engine, 8);
+  blc_write(&w, expr);
+  return (CacheKey){expr_mix(expr_hash(expr), engine), w.buf};
+}
+
+static CacheSlot *cache_find(Cache *c, uint64_t hash, const uint8_t *key,
+                             size_t size) {
+  uint32_t mask = c->header->slot_count - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    CacheSlot *slot = &c->slots[i];
+    if (!slot->key_size ||
+        (slot->hash == hash && slot->key_size == size &&
+         !memcmp(c->data + slot->offset, key, size)))
+      return slot;
+  }
+}
+
+void cache_open(const char *path) {
+  Cache *c = &result_cache;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    ERROR("Cannot open %s", path);
+  if (flock(fd, LOCK_EX))
+    ERROR("Cannot lock %s", path);
+  struct stat st;
+  if (fstat(fd, &st))
+    ERROR("Cannot open %s", path);
+
+  bool fresh = st.st_size == 0;
+  CacheHeader h = {CACHE_MAGIC, CACHE_VERSION, 64, cache_size, 0, 0, 0};
+  if (fresh) {
+    while (h.slot_count < cache_size / 128)
+      h.slot_count *= 2;
+    c->size = sizeof(h) + h.slot_count * sizeof(CacheSlot) + h.data_size;
+    if (ftruncate(fd, c->size))
+      ERROR("Cannot resize %s", path);
+  } else {
+    c->size = st.st_size;
+  }
+  if (c->size < sizeof(CacheHeader))
+    ERROR("%s is not a result cache", path);
+  void *data =
+      mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    ERROR("Cannot map %s", path);
+  c->fd = fd;
+  c->header = data;
+  if (fresh)
+    *c->header = h;
+
+  h = *c->header;
+  if (memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+      h.version != CACHE_VERSION)
+    ERROR("%s is not a version %d result cache", path, CACHE_VERSION);
+  if (!h.slot_count || h.slot_count & (h.slot_count - 1) ||
+      c->size != sizeof(h) + h.slot_count * sizeof(CacheSlot) + h.data_size ||
+      h.data_used > h.data_size || h.entries > h.slot_count / 2)
+    ERROR("%s is corrupt", path);
+  c->slots = (CacheSlot *)(c->header + 1);
+  c->data = (uint8_t *)(c->slots + h.slot_count);
+  uint64_t entries = 0;
+  for (uint32_t i = 0; i < h.slot_count; i++) {
+    CacheSlot *slot = &c->slots[i];
+    if (!slot->key_size)
+      continue;
+    if (slot->offset + slot->key_size + slot->value_size > h.data_used)
+      ERROR("%s is corrupt", path);
+    entries++;
+  }
+  if (entries != h.entries)
+    ERROR("%s is corrupt", path);
+  flock(fd, LOCK_UN);
+}
+
+// Take the cache from other threads and processes.
+static void cache_lock(Cache *c) {
+  pthread_mutex_lock(&c->lock);
+  if (flock(c->fd, LOCK_EX))
+    ERROR("Cannot lock the result cache");
+}
+
+static void cache_unlock(Cache *c) {
+  flock(c->fd, LOCK_UN);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_close(void) {
+  Cache *c = &result_cache;
+  if (!c->header)
+    return;
+  munmap(c->header, c->size);
+  close(c->fd);
+  c->header = NULL;
+  c->fd = -1;
+}
+
+// The cached result for `key`, built in the current arenas, or NULL.
+Expr *cache_lookup(const CacheKey *key) {
+  Cache *c = &result_cache;
+  if (!c->header)
+    return NULL;
+  cache_lock(c);
+  CacheSlot *slot = cache_find(c, key->hash, key->bytes, arrlenu(key->bytes));
+  Expr *res = NULL;
+  if (slot->key_size) {
+    slot->used = ++c->header->clock;
+    const uint8_t *value = c->data + slot->offset + slot->key_size;
+    BitReader r = {value, value + slot->value_size, 0, 0};
+    res = blc_read(&r);
+    stats.cache_hits++;
+  } else {
+    stats.cache_misses++;
+  }
+  cache_unlock(c);
+  return res;
+}
+
+static int cache_by_use(const void *a, const void *b) {
+  uint64_t x = ((const CacheSlot *)a)->used, y = ((const CacheSlot *)b)->used;
+  return (x > y) - (x < y);
+}
+
+static int cache_by_offset(const void *a, const void *b) {
+  uint64_t x = ((const CacheSlot *)a)->offset;
+  uint64_t y = ((const CacheSlot *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+// Make room for an entry of `need` bytes: drop the least recently used
+// entries, compact the data area and rebuild the table.
+static void cache_evict(Cache *c, size_t need) {
+  CacheHeader *h = c->header;
+  CacheSlot *live = malloc(h->entries * sizeof(CacheSlot) + 1);
+  if (!live)
+    ERROR("Memory allocation failed");
+  size_t n = 0;
+  for (uint32_t i = 0; i < h->slot_count; i++)
+    if (c->slots[i].key_size)
+      live[n++] = c->slots[i];
+
+  qsort(live, n, sizeof(CacheSlot), cache_by_use);
+  size_t first = 0, used = h->data_used;
+  size_t budget = h->data_size - h->data_size / 8;
+  for (; first < n && (used + need > budget || n - first > h->slot_count / 4);
+       first++)
+    used -= live[first].key_size + live[first].value_size;
+
+  qsort(live + first, n - first, sizeof(CacheSlot), cache_by_offset);
+  memset(c->slots, 0, h->slot_count * sizeof(CacheSlot));
+  used = 0;
+  for (size_t i = first; i < n; i++) {
+    size_t size = live[i].key_size + live[i].value_size;
+    memmove(c->data + used, c->data + live[i].offset, size);
+    live[i].offset = used;
+    used += size;
+    *cache_find(c, live[i].hash, c->data + used - size, live[i].key_size) =
+        live[i];
+  }
+  h->data_used = used;
+  h->entries = n - first;
+  free(live);
+}
+
+// Record `res` as the result for `key`. Entries larger than half the data
+// area are not kept.
+void cache_store(const CacheKey *key, const Expr *res) {
+  Cache *c = &result_cache;
+  if (!c->header)
+    return;
+  BitWriter w = {0};
+  blc_write(&w, res);
+  size_t key_size = arrlenu(key->bytes), value_size = arrlenu(w.buf);
+  size_t need = key_size + value_size;
+
+  cache_lock(c);
+  CacheHeader *h = c->header;
+  if (need <= h->data_size / 2 &&
+      !cache_find(c, key->hash, key->bytes, key_size)->key_size) {
+    if (h->data_used + need > h->data_size || h->entries >= h->slot_count / 2)
+      cache_evict(c, need);
+    memcpy(c->data + h->data_used, key->bytes, key_size);
+    memcpy(c->data + h->data_used + key_size, w.buf, value_size);
+    *cache_find(c, key->hash, key->bytes, key_size) = (CacheSlot){
+        key->hash, h->data_used, key_size, value_size, ++h->clock};
+    h->data_used += need;
+    h->entries++;
+  }
+  cache_unlock(c);
+  arrfree(w.buf);
+}
+
+// run() through the result cache, when one is open.
+Expr *run_cached(Engine engine, Expr *expr, Stack *s) {
+  if (!result_cache.header)
+    return run(engine, expr, s);
+  CacheKey key = cache_key(engine, expr);
+  Expr *res = cache_lookup(&key);
+  if (!res) {
+    res = run(engine, expr, s);
+    cache_store(&key, res);
+  }
+  arrfree(key.bytes);
+  return res;
+}
+
+// Batch evaluation of a file (or stdin, for NULL or "-") holding any number of
+// terms, one or more per line. Results are written one per line, in input
+// order. The calling thread reads the input in chunks of whole lines into a
+// bounded queue; `parallel_threads` workers parse, evaluate and serialize the
+// terms of a chunk, each with arenas and a stack of its own, resetting them
+// after every term; a writer thread puts the results back in order through a
+// reorder buffer. The reader waits while `batch_window` chunks are in flight,
+// so memory stays bounded however long the input is.
+#define BATCH_CHUNK (1 << 16)
+
+size_t batch_window = 64;
+
+typedef struct {
+  size_t index;
+  char *data; // whole lines; NULL stops the worker that takes it
+  size_t size;
+  Writer out;
+} BatchItem;
+
+typedef struct {
+  Engine engine;
+  bool named;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // the queue is no longer empty
+  pthread_cond_t space; // a chunk may be queued
+  pthread_cond_t ready; // a result or the end of input arrived
+  BatchItem **queue;    // ring of `capacity` chunks waiting for a worker
+  size_t head, queued, capacity;
+  BatchItem **pending; // chunk i waits in slot i % batch_window
+  size_t written;
+  size_t total; // chunks in the input, SIZE_MAX until it has been read
+} Batch;
+
+typedef struct {
+  Batch *batch;
+  pthread_t thread;
+  Stats stats;
+} BatchWorker;
+
+// Engines that keep state across terms get a per-term equivalent, since
+// every term is evaluated only once and on any thread.
+static Expr *batch_eval(Engine engine, Expr *expr, Stack *s) {
+  if (engine == ENGINE_NORMALIZE)
+    return normalize(expr);
+  if (engine != ENGINE_JIT)
+    return run(engine, expr, s);
+  JitCode jit;
+  if (jit_threshold > 0 || !jit_compile(expr, &jit)) {
+    Program p = compile(expr);
+    Expr *res = vm_eval(&p);
+    program_free(&p);
+    return res;
+  }
+  Expr *res = jit_run(&jit);
+  jit_free(&jit);
+  return res;
+}
+
+static void batch_chunk(Batch *b, BatchItem *it, Arena *arena, Stack *s) {
+  NamedParser np = named_parser(it->data, it->size);
+  Parser ps = {it->data, it->data, it->data + it->size};
+  for (;;) {
+    double t = stats_clock();
+    Expr *expr = b->named ? parse_named(&np) : parse_expr(&ps);
+    double t1 = stats_clock();
+    stats.time[PHASE_LOAD] += t1 - t;
+    if (!expr)
+      break;
+    CacheKey key = {0};
+    Expr *res = NULL;
+    if (result_cache.header) {
+      key = cache_key(b->engine, expr);
+      res = cache_lookup(&key);
+    }
+    if (!res) {
+      res = batch_eval(b->engine, expr, s);
+      cache_store(&key, res);
+    }
+    arrfree(key.bytes);
+    double t2 = stats_clock();
+    if (b->named)
+      write_named(&it->out, res);
+    else
+      write_expr(&it->out, res);
+    writer_putc(&it->out, '\n');
+    stats.time[PHASE_EVAL] += t2 - t1;
+    stats.time[PHASE_PRINT] += stats_clock() - t2;
+    arena_reset(arena);
+    arena_reset(&eval_arena);
+  }
+  named_parser_free(&np);
+}
+
+static void *batch_worker(void *arg) {
+  BatchWorker *w = arg;
+  Batch *b = w->batch;
+  Arena arena = {0};
+  Stack s = NULL;
+  node_arena = &arena;
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    while (b->queued == 0)
+      pthread_cond_wait(&b->work, &b->lock);
+    BatchItem *it = b->queue[b->head];
+    b->head = (b->head + 1) % b->capacity;
+    b->queued--;
+    pthread_cond_signal(&b->space);
+    pthread_mutex_unlock(&b->lock);
+    if (!it->data) {
+      free(it);
+      break;
+    }
+
+    batch_chunk(b, it, &arena, &s);
+    free(it->data);
+
+    pthread_mutex_lock(&b->lock);
+    b->pending[it->index % batch_window] = it;
+    pthread_cond_signal(&b->ready);
+    pthread_mutex_unlock(&b->lock);
+  }
+
+  w->stats = stats;
+  arrfree(s);
+  arena_free(&arena);
+  arena_free(&eval_arena);
+  trace_thread_exit();
+  return NULL;
+}
+
+static void *batch_writer(void *arg) {
+  Batch *b = arg;
+  pthread_mutex_lock(&b->lock);
+  while (b->written < b->total) {
+    BatchItem **slot = &b->pending[b->written % batch_window];
+    if (!*slot) {
+      pthread_cond_wait(&b->ready, &b->lock);
+      continue;
+    }
+    BatchItem *it = *slot;
+    *slot = NULL;
+    b->written++;
+    pthread_cond_signal(&b->space);
+    pthread_mutex_unlock(&b->lock);
+
+    it->out.fd = STDOUT_FILENO;
+    writer_free(&it->out);
+    free(it);
+    pthread_mutex_lock(&b->lock);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+// Queue `it` once there is room, and for a chunk, once fewer than
+// batch_window chunks are in flight.
+static void batch_queue(Batch *b, BatchItem *it) {
+  pthread_mutex_lock(&b->lock);
+  while (b->queued == b->capacity ||
+         (it->data && it->index - b->written >= batch_window))
+    pthread_cond_wait(&b->space, &b->lock);
+  b->queue[(b->head + b->queued) % b->capacity] = it;
+  b->queued++;
+  pthread_cond_signal(&b->work);
+  pthread_mutex_unlock(&b->lock);
+}
+
+static BatchItem *batch_item(size_t index, char *data, size_t size) {
+  BatchItem *it = malloc(sizeof(BatchItem));
+  if (!it)
+    ERROR("Memory allocation failed");
+  *it = (BatchItem){index, data, size, writer_mem()};
+  return it;
+}
+
+void batch_run(const char *path, Engine engine, bool named) {
+  if (hash_cons || refcount || gc)
+    ERROR("Batch evaluation needs --hash-cons, --refcount and --gc off");
+  bool is_stdin = !path || !strcmp(path, "-");
+  int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0)
+    ERROR("Cannot open %s", path);
+
+  unsigned threads = parallel_threads ? parallel_threads : 1;
+  Batch b = {.engine = engine, .named = named, .total = SIZE_MAX};
+  b.capacity = 2 * threads;
+  b.queue = calloc(b.capacity, sizeof(BatchItem *));
+  b.pending = calloc(batch_window, sizeof(BatchItem *));
+  BatchWorker *workers = calloc(threads, sizeof(BatchWorker));
+  if (!b.queue || !b.pending || !workers)
+    ERROR("Memory allocation failed");
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.work, NULL);
+  pthread_cond_init(&b.space, NULL);
+  pthread_cond_init(&b.ready, NULL);
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, batch_writer, &b))
+    ERROR("Cannot start writer thread");
+  for (unsigned i = 0; i < threads; i++) {
+    workers[i].batch = &b;
+    if (pthread_create(&workers[i].thread, NULL, batch_worker, &workers[i]))
+      ERROR("Cannot start worker thread");
+  }
+
+  // Gather at least BATCH_CHUNK bytes, then hand over every complete line;
+  // a partial last line moves on to the next chunk.
+  size_t chunks = 0, len = 0, cap = 2 * BATCH_CHUNK;
+  char *buf = malloc(cap);
+  if (!buf)
+    ERROR("Memory allocation failed");
+  for (bool eof = false; !eof;) {
+    if (len == cap && !(buf = realloc(buf, cap *= 2)))
+      ERROR("Memory allocation failed");
+    ssize_t n = read(fd, buf + len, cap - len);
+    if (n < 0)
+      ERROR("Cannot read %s", is_stdin ? "stdin" : path);
+    len += n, eof = n == 0;
+    if (len < BATCH_CHUNK && !eof)
+      continue;
+    size_t end = len;
+    while (!eof && end > 0 && buf[end - 1] != '\n')
+      end--;
+    if (end == 0 && !eof)
+      continue;
+
+    char *rest = malloc(cap);
+    if (!rest)
+      ERROR("Memory allocation failed");
+    memcpy(rest, buf + end, len - end);
+    if (end > 0)
+      batch_queue(&b, batch_item(chunks++, buf, end));
+    else
+      free(buf);
+    buf = rest, len -= end;
+  }
+  free(buf);
+  if (!is_stdin)
+    close(fd);
+
+  pthread_mutex_lock(&b.lock);
+  b.total = chunks;
+  pthread_cond_signal(&b.ready);
+  pthread_mutex_unlock(&b.lock);
+  for (unsigned i = 0; i < threads; i++)
+    batch_queue(&b, batch_item(0, NULL, 0));
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    stats_merge(&workers[i].stats);
+  }
+  pthread_join(writer, NULL);
+
+  pthread_mutex_destroy(&b.lock);
+  pthread_cond_destroy(&b.work);
+  pthread_cond_destroy(&b.space);
+  pthread_cond_destroy(&b.ready);
+  free(b.queue);
+  free(b.pending);
+  free(workers);
+}
+
+#endif
@@ -1,186 +1,198 @@
-#include "string.h"
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include "lambda.h"
 
-#include "cpp_magic.h"
-#define STB_DS_IMPLEMENTATION
-#include "stb_ds.h"
-
-#define DEBUG 1
-
-typedef unsigned int Variable;
-typedef struct Abstraction Abstraction;
-typedef struct Application Application;
-typedef struct Expr Expr;
-
-struct Abstraction {
-  Expr *body;
-};
-
-struct Application {
-  Expr *func;
-  Expr *arg;
-};
-
-typedef enum { EXPR_VAR, EXPR_ABS, EXPR_APP } ExprType;
-
-typedef struct Expr {
-  ExprType type;
-  union {
-    Variable var;
-    Abstraction abs;
-    Application app;
-  };
-} Expr;
-
-typedef Expr *Stack;
-
-#define ERROR(msg, ...)                                                        \
-  {                                                                            \
-    fprintf(stderr, "Error: " msg "\n", ##__VA_ARGS__);                        \
-    exit(EXIT_FAILURE);                                                        \
-  }                                                                            \
-  while (0)
-
-#define CHECK_NULL_ARGS_(var) !(var)
-#define OR_OP() ||
-#define CHECK_NULL_ARGS(...)                                                   \
-  if (EVAL(MAP(CHECK_NULL_ARGS_, OR_OP, __VA_ARGS__)))                         \
-    ERROR("NULL argument(s) passed to function");
-
-#define NEW_EXPR                                                               \
-  ({                                                                           \
-    Expr *e = malloc(sizeof(Expr));                                            \
-    if (!e)                                                                    \
-      ERROR("Memory allocation failed");                                       \
-    e;                                                                         \
-  })
-
-#define NEW_EXPR_IMPL(check, initialize)                                       \
-  {                                                                            \
-    CHECK_NULL_ARGS check;                                                     \
-    Expr *e = NEW_EXPR;                                                        \
-    initialize;                                                                \
-    return e;                                                                  \
-  }
-
-Expr *new_abs(Expr *body) NEW_EXPR_IMPL((body), {
-  e->type = EXPR_ABS;
-  e->abs.body = body;
-});
-
-Expr *new_app(Expr *func, Expr *arg) NEW_EXPR_IMPL((func, arg), {
-  e->type = EXPR_APP;
-  e->app.func = func;
-  e->app.arg = arg;
-});
-
-Expr *new_var(Variable var) NEW_EXPR_IMPL((var), {
-  e->type = EXPR_VAR;
-  e->var = var;
-});
-
-#undef NEW_EXPR_IMPL
-#undef NEW_EXPR
-#undef CHECK_NULL_ARGS
-#undef CHECK_NULL_ARGS_
-
-void _print_expr(const Expr *expr) {
-  if (!expr)
-    ERROR("NULL expression");
-
-  switch (expr->type) {
-  case EXPR_VAR:
-    printf("%u", expr->var);
-    break;
-  case EXPR_ABS: {
-    printf("(λ ");
-    _print_expr(expr->abs.body);
-    putchar(')');
-    break;
-  }
-  case EXPR_APP: {
-    putchar('(');
-    _print_expr(expr->app.func);
-    putchar(' ');
-    _print_expr(expr->app.arg);
-    putchar(')');
-    break;
+int main(int argc, char *argv[]) {
+  Stack s = NULL;
+  Engine engine = ENGINE_EVAL;
+  const char *path = NULL;
+  const char *save_image = NULL, *save_blc = NULL, *trace_path = NULL;
+  const char *cache_path = NULL;
+  bool named = false, image = false, verify = false, batch = false;
+  bool blc = false, blc_text = false;
+  enum { STATS_OFF, STATS_LINE, STATS_JSON } show_stats = STATS_OFF;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--hash-cons"))
+      hash_cons = true;
+    else if (!strcmp(argv[i], "--refcount"))
+      refcount = true;
+    else if (!strcmp(argv[i], "--gc"))
+      gc = true;
+    else if (!strcmp(argv[i], "--krivine"))
+      engine = ENGINE_KRIVINE;
+    else if (!strcmp(argv[i], "--lazy"))
+      engine = ENGINE_LAZY;
+    else if (!strcmp(argv[i], "--vm"))
+      engine = ENGINE_VM;
+    else if (!strcmp(argv[i], "--jit"))
+      engine = ENGINE_JIT, jit_threshold = 0;
+    else if (!strncmp(argv[i], "--jit-threshold=", 16))
+      engine = ENGINE_JIT, jit_threshold = strtoul(argv[i] + 16, NULL, 10);
+    else if (!strcmp(argv[i], "--normalize"))
+      engine = ENGINE_NORMALIZE;
+    else if (!strcmp(argv[i], "--net"))
+      engine = ENGINE_NET;
+    else if (!strncmp(argv[i], "--net-limit=", 12))
+      net_limit = strtoull(argv[i] + 12, NULL, 10);
+    else if (!strcmp(argv[i], "--batch"))
+      batch = true;
+    else if (!strncmp(argv[i], "--threads=", 10))
+      parallel_threads = atoi(argv[i] + 10);
+    else if (!strcmp(argv[i], "--named"))
+      named = true;
+    else if (!strcmp(argv[i], "--image"))
+      image = true;
+    else if (!strcmp(argv[i], "--verify"))
+      verify = true;
+    else if (!strncmp(argv[i], "--save-image=", 13))
+      save_image = argv[i] + 13;
+    else if (!strcmp(argv[i], "--blc"))
+      blc = true;
+    else if (!strcmp(argv[i], "--blc-text"))
+      blc_text = true;
+    else if (!strncmp(argv[i], "--save-blc=", 11))
+      save_blc = argv[i] + 11;
+    else if (!strncmp(argv[i], "--cache=", 8))
+      cache_path = argv[i] + 8;
+    else if (!strncmp(argv[i], "--cache-size=", 13))
+      cache_size = strtoull(argv[i] + 13, NULL, 10) << 20;
+    else if (!strncmp(argv[i], "--trace=", 8))
+      trace_path = argv[i] + 8;
+    else if (!strcmp(argv[i], "--stats"))
+      show_stats = STATS_LINE;
+    else if (!strcmp(argv[i], "--stats=json"))
+      show_stats = STATS_JSON;
+    else if (argv[i][0] != '-' || !strcmp(argv[i], "-"))
+      path = argv[i];
+    else
+      ERROR("Unknown option %s", argv[i]);
   }
+  if (gc && refcount)
+    ERROR("--gc and --refcount cannot be combined");
+  if (cache_size < 1 << 20)
+    ERROR("--cache-size must be at least 1 (MB)");
+  if (cache_path)
+    cache_open(cache_path);
+
+  // One term or more per line, evaluated on --threads=N workers.
+  if (batch) {
+    if (image || blc || save_image || save_blc)
+      ERROR("--batch reads terms in the textual syntax only");
+    if (trace_path)
+      trace_open(trace_path);
+    trace_enable(trace_path != NULL);
+    batch_run(path, engine, named);
+    trace_enable(false);
+    trace_close();
+    cache_close();
+    if (show_stats)
+      stats_print(stderr, show_stats == STATS_JSON);
+    return EXIT_SUCCESS;
   }
-}
-
-#define print_expr(expr)                                                       \
-  {                                                                            \
-    _print_expr((expr));                                                       \
-    putchar('\n');                                                             \
-  }                                                                            \
-  while (0)
-
-#define STRINGIFY_INNER(x) #x
-#define STRINGIFY(x) STRINGIFY_INNER(x)
-#if DEBUG
-#define dbg_stack(s)                                                           \
-  {                                                                            \
-    puts("-------------------");                                               \
-    puts("Stack contents at " __FILE__ ":" STRINGIFY(__LINE__) ":");           \
-                                                                               \
-    for (ptrdiff_t i = arrlen((s)) - 1, j = 1; i >= 0; --i, j++) {             \
-      printf("  [%ld] ", j);                                                   \
-      print_expr(&(s)[i]);                                                     \
-    }                                                                          \
-                                                                               \
-    if (arrlen((s)) == 0)                                                      \
-      puts("  (empty stack)");                                                 \
-                                                                               \
-    puts("-------------------");                                               \
-  }                                                                            \
-  while (0)
-#else
-#define print_stack(s)
-#endif
 
-Expr *eval(Expr *expr, Stack *s) {
-  switch (expr->type) {
-  case EXPR_VAR: {
-    Variable var = expr->var;
-    ptrdiff_t len = arrlen(*s);
-    if (var > len)
-      ERROR("Variable %u not found in stack", var);
-    return s[len - var];
+  Expr **terms = NULL;
+  Image img = {0};
+  double t = stats_clock();
+  if (path && image) {
+    img = image_open(path, verify);
+  } else if (path && blc) {
+    terms = parse_blc_file(path, blc_text);
+  } else if (path) {
+    terms = named ? parse_named_file(path) : parse_file(path);
+  } else {
+    Expr *one = new_var(1);
+    Expr *two = new_var(2);
+    Expr *id = new_abs(one);
+    Expr *sb = new_abs(two);
+
+    Expr *inner = new_abs(two);
+    Expr *outer = new_abs(inner);
+    print_expr(outer);
+
+    Expr *app1 = new_app(outer, id);
+    Expr *app2 = new_app(app1, sb);
+    print_expr(app2);
+    arrput(terms, app2);
   }
-  case EXPR_APP: {
-    Expr *arg = eval(expr->app.arg, s);
-    Expr *func = eval(expr->app.func, s);
-    dbg_stack(*s);
-    arrput(*s, *arg);
-    Expr *res = eval(func->abs.body, s);
-    dbg_stack(*s);
-    return res;
+  stats.time[PHASE_LOAD] += stats_clock() - t;
+
+  if (save_image || save_blc) {
+    if (save_image)
+      image_write(save_image, terms, arrlen(terms));
+    if (save_blc)
+      write_blc_file(save_blc, terms, arrlen(terms), blc_text);
+    arrfree(terms);
+    return EXIT_SUCCESS;
   }
-  default:
-    return expr;
-  }
-}
 
-int main(int argc, char *argv[]) {
-  Stack s = NULL;
-
-  Expr *one = new_var(1);
-  Expr *two = new_var(2);
-  Expr *id = new_abs(one);
-  Expr *sb = new_abs(two);
-
-  Expr *inner = new_abs(two);
-  Expr *outer = new_abs(inner);
-  print_expr(outer);
+  // Image terms run on the mapped nodes with --krivine and are rebuilt as
+  // Expr for the other engines.
+  // With --refcount each term and its result are released once printed, so
+  // memory stays flat over a long input.
+  for (ptrdiff_t i = 0; i < arrlen(terms); i++)
+    expr_retain(terms[i]);
+  // With --gc the pending terms are the roots between evaluations.
+  gc_root(&terms, sizeof(Expr *), 0);
+
+  size_t count = img.header ? img.header->root_count : arrlenu(terms);
+  if (trace_path)
+    trace_open(trace_path);
+  trace_enable(trace_path != NULL);
+  for (size_t i = 0; i < count; i++) {
+    Expr *term = NULL, *res;
+    t = stats_clock();
+    if (!img.header)
+      res = run_cached(engine, term = terms[i], &s);
+    else if (engine == ENGINE_KRIVINE)
+      res = store_krivine(img.nodes, img.roots[i]);
+    else
+      res = run_cached(
+          engine, term = expr_retain(store_to_expr(img.nodes, img.roots[i])),
+          &s);
+    expr_retain(res);
+
+    double t1 = stats_clock();
+    if (named) {
+      print_named(res);
+    } else {
+      print_expr(res);
+    }
+    stats.time[PHASE_EVAL] += t1 - t;
+    stats.time[PHASE_PRINT] += stats_clock() - t1;
+
+    // Environments and other scratch data of the engines end with the term.
+    arena_reset(&eval_arena);
+    if (refcount) {
+      if (term)
+        jit_forget(term);
+      expr_release(res);
+      if (term)
+        expr_release(term);
+      expr_sweep();
+    }
+    if (gc) {
+      if (terms)
+        terms[i] = NULL;
+      if (gc_due()) {
+        jit_reset();
+        gc_collect();
+      }
+    }
+  }
 
-  Expr *app1 = new_app(outer, id);
-  Expr *app2 = new_app(app1, sb);
-  print_expr(app2);
-  Expr *expr = eval(app2, &s);
-  print_expr(expr);
+  trace_enable(false);
+  if (show_stats)
+    stats_print(stderr, show_stats == STATS_JSON);
+  trace_close();
+
+  if (img.header)
+    image_close(&img);
+  cache_close();
+  arrfree(terms);
+  arrfree(s);
+  jit_reset();
+  expr_reset();
+  arena_free(&expr_arena);
+  arena_free(&eval_arena);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,260 @@
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "lambda.h"
+
+// Hardware counters read around each measurement. Any counter the kernel
+// refuses (no PMU in a VM, perf_event_paranoid, ...) is left out, and its
+// column stays empty.
+typedef enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_COUNT
+} Counter;
+
+static const uint64_t counter_configs[COUNTER_COUNT] = {
+    [COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [COUNTER_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int counter_fds[COUNTER_COUNT];
+
+static void counters_open(bool enabled) {
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = counter_configs[i],
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    counter_fds[i] =
+        enabled ? syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0) : -1;
+  }
+}
+
+static void counters_start(void) {
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void counters_stop(uint64_t values[COUNTER_COUNT]) {
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    values[i] = 0;
+    if (counter_fds[i] < 0)
+      continue;
+    ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter_fds[i], &values[i], sizeof(values[i])) !=
+        sizeof(values[i]))
+      values[i] = 0;
+  }
+}
+
+static void counters_close(void) {
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    if (counter_fds[i] >= 0)
+      close(counter_fds[i]);
+}
+
+// Results go here so the compiler cannot drop the measured work.
+static volatile uintptr_t sink;
+
+// Fixtures built by a primitive's setup, outside the measured region.
+static Expr *fixture_term;
+static Env *fixture_env;
+
+#define LOOKUP_DEPTH 16
+
+// Each primitive runs `n` times and returns the number of operations done.
+typedef struct {
+  const char *name;
+  void (*setup)(void);
+  size_t (*run)(size_t n);
+} Micro;
+
+static void setup_empty(void) {
+  jit_reset();
+  expr_reset();
+  hash_cons = false;
+}
+
+static void setup_hash_cons(void) {
+  setup_empty();
+  hash_cons = true;
+}
+
+static void setup_lookup(void) {
+  setup_empty();
+  fixture_env = NULL;
+  for (Variable i = 0; i < LOOKUP_DEPTH; i++)
+    fixture_env = env_push((Closure){new_var(1), NULL}, fixture_env);
+}
+
+static void setup_print(void) {
+  setup_empty();
+  // A Church numeral: deep, but mixing all three node types.
+  Expr *body = new_var(1);
+  for (int i = 0; i < 1000; i++)
+    body = new_app(new_var(2), body);
+  fixture_term = new_abs(new_abs(body));
+}
+
+static size_t run_new_var(size_t n) {
+  for (size_t i = 0; i < n; i++)
+    sink = (uintptr_t)new_var((i & 7) + 1);
+  return n;
+}
+
+static size_t run_new_abs(size_t n) {
+  Expr *e = new_var(1);
+  for (size_t i = 0; i < n; i++)
+    e = new_abs(e);
+  sink = (uintptr_t)e;
+  return n;
+}
+
+static size_t run_new_app(size_t n) {
+  Expr *e = new_var(1), *x = new_var(2);
+  for (size_t i = 0; i < n; i++)
+    e = new_app(e, x);
+  sink = (uintptr_t)e;
+  return n;
+}
+
+// Small operands, so nearly every call hits the table.
+static size_t run_new_app_shared(size_t n) {
+  Expr *vars[8];
+  for (int i = 0; i < 8; i++)
+    vars[i] = new_var(i + 1);
+  for (size_t i = 0; i < n; i++)
+    sink = (uintptr_t)new_app(vars[i & 7], vars[(i >> 3) & 7]);
+  return n;
+}
+
+// Frames pushed onto a fresh stack, growth included.
+static size_t run_arrput(size_t n) {
+  Stack s = NULL;
+  Frame f = {FRAME_ARG, {NULL, NULL}};
+  for (size_t i = 0; i < n; i++) {
+    if (i % 4096 == 0)
+      arrfree(s);
+    f.clo.term = (Expr *)i;
+    arrput(s, f);
+  }
+  sink = (uintptr_t)s;
+  arrfree(s);
+  return n;
+}
+
+static size_t run_lookup(size_t n) {
+  for (size_t i = 0; i < n; i++)
+    sink = (uintptr_t)env_lookup(fixture_env, (i % LOOKUP_DEPTH) + 1).term;
+  return n;
+}
+
+// The serializer behind _print_expr, into memory so no write(2) is measured.
+// One operation is one node written.
+static size_t run_print(size_t n) {
+  Writer w = writer_mem();
+  size_t nodes = 2 * 1000 + 3, ops = 0;
+  for (; ops < n; ops += nodes) {
+    arrsetlen(w.buf, 0);
+    write_expr(&w, fixture_term);
+  }
+  sink = arrlenu(w.buf);
+  writer_free(&w);
+  return ops;
+}
+
+static const Micro micros[] = {
+    {"new_var", setup_empty, run_new_var},
+    {"new_abs", setup_empty, run_new_abs},
+    {"new_app", setup_empty, run_new_app},
+    {"new_app_hash_cons", setup_hash_cons, run_new_app_shared},
+    {"arrput", setup_empty, run_arrput},
+    {"env_lookup", setup_lookup, run_lookup},
+    {"write_expr", setup_print, run_print},
+};
+
+// Keep the fastest of `reps` runs: the others only add scheduler noise.
+static void measure(const Micro *m, size_t iters, int reps) {
+  double best = 0;
+  size_t ops = 0;
+  uint64_t values[COUNTER_COUNT] = {0};
+
+  for (int r = 0; r < reps; r++) {
+    uint64_t v[COUNTER_COUNT];
+    m->setup();
+    counters_start();
+    double start = stats_clock();
+    size_t done = m->run(iters);
+    double time = stats_clock() - start;
+    counters_stop(v);
+    if (r == 0 || time < best) {
+      best = time, ops = done;
+      memcpy(values, v, sizeof(values));
+    }
+  }
+
+  printf("%s,%zu,%.3f", m->name, ops, best * 1e9 / ops);
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    if (counter_fds[i] >= 0)
+      printf(",%.3f", (double)values[i] / ops);
+    else
+      printf(",");
+  putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = sizeof(micros) / sizeof(*micros);
+  bool selected[sizeof(micros) / sizeof(*micros)] = {0};
+  bool any = false, counters = true;
+  size_t iters = 1 << 22;
+  int reps = 5;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--iters=", 8)) {
+      iters = strtoull(argv[i] + 8, NULL, 10);
+      if (!iters)
+        ERROR("--iters must be positive");
+    } else if (!strncmp(argv[i], "--reps=", 7)) {
+      reps = atoi(argv[i] + 7);
+      if (reps < 1)
+        ERROR("--reps must be positive");
+    } else if (!strcmp(argv[i], "--no-counters")) {
+      counters = false;
+    } else if (argv[i][0] != '-') {
+      size_t m = 0;
+      while (m < count && strcmp(argv[i], micros[m].name))
+        m++;
+      if (m == count)
+        ERROR("Unknown primitive %s", argv[i]);
+      selected[m] = any = true;
+    } else {
+      ERROR("Unknown option %s", argv[i]);
+    }
+  }
+
+  counters_open(counters);
+  puts("primitive,ops,ns_per_op,cycles_per_op,instructions_per_op,"
+       "cache_misses_per_op,branch_misses_per_op");
+  for (size_t m = 0; m < count; m++)
+    if (!any || selected[m])
+      measure(&micros[m], iters, reps);
+  counters_close();
+
+  jit_reset();
+  expr_reset();
+  arena_free(&expr_arena);
+  arena_free(&eval_arena);
+  return 0;
+}
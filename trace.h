@@ -0,0 +1,49 @@
+// On-disk format of reduction traces, shared by lambda.h and tracedump.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+typedef enum {
+  TRACE_BETA,   // a redex was contracted; info is the stack depth
+  TRACE_PUSH,   // a frame was pushed; info is the new stack depth
+  TRACE_LOOKUP, // a variable was looked up; info is its de Bruijn index
+  TRACE_UPDATE, // a call-by-need thunk was overwritten by its value
+  TRACE_CLOCK,  // a timestamp, see below
+  TRACE_KIND_COUNT
+} TraceKind;
+
+static const char *const trace_kind_names[TRACE_KIND_COUNT] = {
+    "beta", "push", "lookup", "update", "clock"};
+
+// 8 bytes per event. `node` identifies the term involved by its address
+// divided by the node alignment; it is only meaningful within one trace.
+// Reading the clock costs more than recording an event, so events carry no
+// time of their own: every TRACE_CLOCK_INTERVAL events a TRACE_CLOCK event
+// holds the nanoseconds since tracing started (low 32 bits in `node`, the rest
+// in the info field), and readers interpolate between those.
+typedef struct {
+  uint32_t node;
+  uint32_t info; // kind in the low 4 bits, kind-specific value above
+} TraceEvent;
+
+#define TRACE_CLOCK_INTERVAL 256
+
+#define TRACE_KIND(ev) ((TraceKind)((ev).info & 0xf))
+#define TRACE_INFO(ev) ((ev).info >> 4)
+#define TRACE_TIME(ev) ((uint64_t)TRACE_INFO(ev) << 32 | (ev).node)
+
+// A trace file is a sequence of sections, one per thread, each a header
+// followed by `count` events, oldest first.
+typedef struct {
+  char magic[8]; // "LCTRACE"
+  uint32_t version;
+  uint32_t thread;
+  uint64_t count;
+  uint64_t dropped; // events overwritten before they were written out
+} TraceHeader;
+
+#define TRACE_MAGIC "LCTRACE"
+#define TRACE_VERSION 1
+
+#endif
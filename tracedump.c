@@ -0,0 +1,128 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Decode a trace written by `lambda --trace=FILE`, either as one line per
+// event or, with --chrome, as Chrome trace JSON (chrome://tracing, Perfetto).
+
+#define ERROR(msg, ...)                                                        \
+  {                                                                            \
+    fprintf(stderr, "Error: " msg "\n", ##__VA_ARGS__);                        \
+    exit(EXIT_FAILURE);                                                        \
+  }                                                                            \
+  while (0)
+
+// Time every event by interpolating between the clock events around it.
+// Events before the first clock get its time, those after the last get the
+// last one's.
+static double *event_times(const TraceHeader *h, const TraceEvent *ev) {
+  double *ns = malloc(h->count * sizeof(double));
+  if (h->count && !ns)
+    ERROR("Memory allocation failed");
+  uint64_t prev = h->count; // index of the previous clock event
+  for (uint64_t i = 0; i < h->count; i++) {
+    if (TRACE_KIND(ev[i]) != TRACE_CLOCK)
+      continue;
+    double t = TRACE_TIME(ev[i]);
+    if (prev == h->count) {
+      for (uint64_t j = 0; j <= i; j++)
+        ns[j] = t;
+    } else {
+      double t0 = ns[prev];
+      for (uint64_t j = prev + 1; j <= i; j++)
+        ns[j] = t0 + (t - t0) * (j - prev) / (i - prev);
+    }
+    prev = i;
+  }
+  for (uint64_t j = prev == h->count ? 0 : prev + 1; j < h->count; j++)
+    ns[j] = prev == h->count ? 0 : ns[prev];
+  return ns;
+}
+
+static void dump_text(const TraceHeader *h, const TraceEvent *ev,
+                      const double *ns) {
+  printf("# thread %u: %" PRIu64 " events, %" PRIu64 " dropped\n", h->thread,
+         h->count, h->dropped);
+  for (uint64_t i = 0; i < h->count; i++)
+    if (TRACE_KIND(ev[i]) != TRACE_CLOCK)
+      printf("%14.3f us  %-6s node=%08x %s=%u\n", ns[i] / 1e3,
+             trace_kind_names[TRACE_KIND(ev[i])], ev[i].node,
+             TRACE_KIND(ev[i]) == TRACE_LOOKUP ? "var" : "depth",
+             TRACE_INFO(ev[i]));
+}
+
+// Every event becomes an instant event; pushes and beta steps also feed a
+// stack depth counter track.
+static void dump_chrome(const TraceHeader *h, const TraceEvent *ev,
+                        const double *ns, bool *first) {
+  for (uint64_t i = 0; i < h->count; i++) {
+    TraceKind kind = TRACE_KIND(ev[i]);
+    double us = ns[i] / 1e3;
+    if (kind == TRACE_CLOCK)
+      continue;
+    printf("%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+           "\"pid\": 1, \"tid\": %u, \"args\": {\"node\": %u, \"%s\": %u}}",
+           *first ? "\n" : ",\n", trace_kind_names[kind], us, h->thread,
+           ev[i].node, kind == TRACE_LOOKUP ? "var" : "depth",
+           TRACE_INFO(ev[i]));
+    *first = false;
+    if (kind == TRACE_PUSH || kind == TRACE_BETA)
+      printf(",\n{\"name\": \"depth\", \"ph\": \"C\", \"ts\": %.3f, "
+             "\"pid\": 1, \"tid\": %u, \"args\": {\"depth\": %u}}",
+             us, h->thread, TRACE_INFO(ev[i]));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = NULL;
+  bool chrome = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--chrome"))
+      chrome = true;
+    else if (argv[i][0] != '-' || !strcmp(argv[i], "-"))
+      path = argv[i];
+    else
+      ERROR("Unknown option %s", argv[i]);
+  }
+  if (!path)
+    ERROR("Usage: %s [--chrome] TRACE", argv[0]);
+
+  FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+  if (!f)
+    ERROR("Cannot open %s", path);
+
+  bool first = true;
+  if (chrome)
+    printf("{\"traceEvents\": [");
+
+  TraceHeader h;
+  while (fread(&h, sizeof(h), 1, f) == 1) {
+    if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)))
+      ERROR("%s is not a trace", path);
+    if (h.version != TRACE_VERSION)
+      ERROR("%s has unsupported version %u", path, h.version);
+
+    TraceEvent *ev = malloc(h.count * sizeof(TraceEvent));
+    if (h.count && !ev)
+      ERROR("Memory allocation failed");
+    if (fread(ev, sizeof(TraceEvent), h.count, f) != h.count)
+      ERROR("%s is truncated", path);
+    double *ns = event_times(&h, ev);
+    if (chrome)
+      dump_chrome(&h, ev, ns, &first);
+    else
+      dump_text(&h, ev, ns);
+    free(ns);
+    free(ev);
+  }
+
+  if (chrome)
+    printf("\n]}\n");
+  if (f != stdin)
+    fclose(f);
+  return EXIT_SUCCESS;
+}